@@ -1,10 +1,44 @@
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <list>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
 #include <vector>
 #include <tuple>
 #include <unordered_map>
 #include <cstdio>
 #include <stdexcept>
+#include <unordered_set>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+#include <zstd_errors.h>
 
 #include "absl/strings/ascii.h"
 
@@ -20,475 +54,7052 @@ using std::cout;
 using std::size_t;
 using std::unordered_map;
 using std::runtime_error;
+using std::int64_t;
 
-class row_tuple {
- public:
-  row_tuple() : row_data({}) {}
-  row_tuple(unordered_map<string, string> row_data) :
-      row_data(std::move(row_data)) {}
-
-  unordered_map<string, string> row_data;
+enum class value_type {
+  null,
+  int64,
+  float64,
+  // Days since 1970-01-01.
+  date,
+  // Seconds since 1970-01-01 00:00:00 UTC.
+  timestamp,
+  string,
 };
 
-inline bool operator==(const row_tuple& lhs, const row_tuple& rhs){
-  return lhs.row_data == rhs.row_data;
-}
-inline bool operator!=(const row_tuple& lhs, const row_tuple& rhs){ return !(lhs == rhs); }
-
-row_tuple join_tuples(const row_tuple& t0, const row_tuple& t1) {
-  unordered_map<string, string> row_tuple_data;
-  for (const auto& p : t0.row_data) {
-    row_tuple_data[p.first] = p.second;
+string value_type_name(value_type type) {
+  switch (type) {
+    case value_type::null: return "null";
+    case value_type::int64: return "int64";
+    case value_type::float64: return "float64";
+    case value_type::date: return "date";
+    case value_type::timestamp: return "timestamp";
+    case value_type::string: return "string";
   }
-  for (const auto& p: t1.row_data) {
-    // TODO: deal with col name collisions?
-    row_tuple_data[p.first] = p.second;
-  }
-  return row_tuple(row_tuple_data);
+  return "unknown";
 }
 
-
-auto EOF_tuple = row_tuple();
-
-class iterator {
+// A single column value. Numbers, dates and timestamps are stored
+// natively so that they are only parsed once, at scan time.
+class value {
  public:
-  virtual void init() = 0;
-  virtual row_tuple next() = 0;
-  virtual void close() = 0;
-};
+  value() : type(value_type::null) {}
+  value(int i) : type(value_type::int64), i(i) {}
+  value(int64_t i) : type(value_type::int64), i(i) {}
+  value(double d) : type(value_type::float64), d(d) {}
+  value(string s) : type(value_type::string), s(std::move(s)) {}
+  value(const char *s) : type(value_type::string), s(s) {}
 
-const int kMaxCSVLineLength = 100000;
+  static value date(int64_t days) {
+    value v(days);
+    v.type = value_type::date;
+    return v;
+  }
 
-class csv_scan_iterator : public iterator {
- public:
-  csv_scan_iterator (string path, vector<string> headers) :
-      path(path), headers(headers) {}
+  static value timestamp(int64_t seconds) {
+    value v(seconds);
+    v.type = value_type::timestamp;
+    return v;
+  }
 
-  void init() {
-    // Read the headers from the first line of the CSV
-    auto fp = std::fopen(this->path.c_str(), "r");
-    if (fp == nullptr) {
-      throw runtime_error("Could not open CSV with path: " + this->path);
-    }
-    this->fp = fp;
+  bool is_null() const { return this->type == value_type::null; }
 
-    vector<size_t> headers_to_csv_cols;
-    int done = 0;
-    int err = 0;
-    char* line = fread_csv_line(fp, kMaxCSVLineLength, &done, &err);
-    if (done) {
-      throw runtime_error("CSV has no data: " + this->path);
+  bool is_numeric() const {
+    return this->type == value_type::int64 || this->type == value_type::float64;
+  }
+
+  double as_double() const {
+    if (this->type == value_type::int64) {
+      return static_cast<double>(this->i);
     }
-    if (err) {
-      throw runtime_error("CSV reading error: " + this->path);
+    if (this->type == value_type::float64) {
+      return this->d;
     }
-    char **parsed = parse_csv(line); // TODO check null/error?
-    free(line);
-    char **parsed_start = parsed;
+    throw runtime_error("Value is not numeric: " + this->to_string());
+  }
 
-    // Get all headers from the csv
-    vector<string> csv_headers;
-    for ( ; *parsed != nullptr ; parsed++ ) {
-      auto s = string(*parsed);
-      absl::AsciiStrToLower(&s);
-      csv_headers.push_back(s);
+  string to_string() const;
+
+  value_type type;
+  // Used by int64, date and timestamp.
+  int64_t i = 0;
+  double d = 0;
+  string s;
+};
+
+// Orders values of different types by type, and numbers (int64 and
+// float64) by their numeric value.
+inline int compare_values(const value& lhs, const value& rhs) {
+  if (lhs.is_numeric() && rhs.is_numeric()) {
+    if (lhs.type == value_type::int64 && rhs.type == value_type::int64) {
+      return (lhs.i > rhs.i) - (lhs.i < rhs.i);
     }
+    double l = lhs.as_double();
+    double r = rhs.as_double();
+    return (l > r) - (l < r);
+  }
+  auto type_rank = [](value_type t) {
+    return t == value_type::float64 ? static_cast<int>(value_type::int64) : static_cast<int>(t);
+  };
+  if (type_rank(lhs.type) != type_rank(rhs.type)) {
+    return type_rank(lhs.type) < type_rank(rhs.type) ? -1 : 1;
+  }
+  switch (lhs.type) {
+    case value_type::null:
+      return 0;
+    case value_type::string:
+      return lhs.s.compare(rhs.s) < 0 ? -1 : (lhs.s == rhs.s ? 0 : 1);
+    default:
+      return (lhs.i > rhs.i) - (lhs.i < rhs.i);
+  }
+}
 
-    for (const auto& h : headers) {
-      auto found = false;
-      // This is O(n^2), but n should be small (hopefully smaller
-      // than the overhead of creating a map?).
-      for (size_t i = 0; i < csv_headers.size(); i++) {
-        auto ch = csv_headers[i];
-        if (h == ch) {
-          found = true;
-          headers_to_csv_cols.push_back(i);
-          break;
+inline bool operator==(const value& lhs, const value& rhs) { return compare_values(lhs, rhs) == 0; }
+inline bool operator!=(const value& lhs, const value& rhs) { return compare_values(lhs, rhs) != 0; }
+inline bool operator<(const value& lhs, const value& rhs) { return compare_values(lhs, rhs) < 0; }
+inline bool operator>(const value& lhs, const value& rhs) { return compare_values(lhs, rhs) > 0; }
+
+// Consistent with operator==: int64 and float64 values that compare
+// equal hash the same.
+struct value_hash {
+  size_t operator()(const value& v) const {
+    switch (v.type) {
+      case value_type::null:
+        return 0;
+      case value_type::int64:
+      case value_type::float64: {
+        double d = v.as_double();
+        if (d == 0) {
+          d = 0;  // -0.0 == 0.0
         }
+        return std::hash<double>()(d);
       }
-      if (!found) {
-        throw runtime_error("Could not find header: " + h + "\n");
-      }
+      case value_type::string:
+        return std::hash<string>()(v.s);
+      default:
+        return std::hash<int64_t>()(v.i) ^ static_cast<size_t>(v.type);
     }
-    this->headers_to_csv_cols = headers_to_csv_cols;
-
-    free_csv_line(parsed_start);
   }
+};
 
-  row_tuple next() {
-    if (this->is_done) {
-      return EOF_tuple;
+struct value_vector_hash {
+  size_t operator()(const vector<value>& vs) const {
+    size_t h = 0;
+    for (const auto& v : vs) {
+      h = h * 31 + value_hash()(v);
     }
-    int done = 0;
-    int err = 0;
-    char *line = fread_csv_line(this->fp, kMaxCSVLineLength, &done, &err);
-    if (done) {
-      this->is_done = true;
-      return EOF_tuple;
+    return h;
+  }
+};
+
+// Converts a civil date to days since 1970-01-01 (proleptic Gregorian).
+int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  const int64_t era = (y >= 0 ? y : y - 399) / 400;
+  const unsigned yoe = static_cast<unsigned>(y - era * 400);
+  const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+void civil_from_days(int64_t z, int64_t *y, unsigned *m, unsigned *d) {
+  z += 719468;
+  const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  const unsigned doe = static_cast<unsigned>(z - era * 146097);
+  const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  const unsigned mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = static_cast<int64_t>(yoe) + era * 400 + (*m <= 2);
+}
+
+string value::to_string() const {
+  char buf[64];
+  switch (this->type) {
+    case value_type::null:
+      return "";
+    case value_type::int64: {
+      auto res = std::to_chars(buf, buf + sizeof(buf), this->i);
+      return string(buf, res.ptr);
     }
-    if (err) {
-      throw runtime_error("CSV read failed with error: " + err);
+    case value_type::float64: {
+      auto res = std::to_chars(buf, buf + sizeof(buf), this->d);
+      return string(buf, res.ptr);
     }
-    char **parsed = parse_csv(line); // TODO check null/error?
-    free(line);
-    unordered_map<string, string> row_tuple_data;
-    for (size_t i = 0; i < this->headers.size(); i++) {
-      auto h = this->headers[i];
-      auto csv_index = this->headers_to_csv_cols[i];
-      row_tuple_data[h] = string(*(parsed + csv_index));
+    case value_type::date:
+    case value_type::timestamp: {
+      int64_t days = this->i;
+      int64_t secs = 0;
+      if (this->type == value_type::timestamp) {
+        days = this->i / 86400;
+        secs = this->i % 86400;
+        if (secs < 0) {
+          secs += 86400;
+          days--;
+        }
+      }
+      int64_t y;
+      unsigned m, d;
+      civil_from_days(days, &y, &m, &d);
+      if (this->type == value_type::date) {
+        std::snprintf(buf, sizeof(buf), "%04lld-%02u-%02u", static_cast<long long>(y), m, d);
+      } else {
+        std::snprintf(buf, sizeof(buf), "%04lld-%02u-%02u %02lld:%02lld:%02lld",
+                      static_cast<long long>(y), m, d, static_cast<long long>(secs / 3600),
+                      static_cast<long long>(secs / 60 % 60), static_cast<long long>(secs % 60));
+      }
+      return string(buf);
     }
-    free_csv_line(parsed);
-    return row_tuple(row_tuple_data);
+    case value_type::string:
+      return this->s;
   }
+  return "";
+}
 
-  void close() {
-    std::fclose(this->fp);
-    this->fp = nullptr;
-    this->is_done = false;
-    this->headers_to_csv_cols = {};
-  }
+std::ostream& operator<<(std::ostream& os, const value& v) {
+  return os << v.to_string();
+}
 
- private:
-  string path;
-  vector<string> headers;
-  FILE *fp;
-  vector<size_t> headers_to_csv_cols;
+bool parse_int64(const char *begin, const char *end, int64_t *out) {
+  auto res = std::from_chars(begin, end, *out);
+  return res.ec == std::errc() && res.ptr == end;
+}
 
-  bool is_done = false;
-};
+// Rejects "nan" and "inf", which from_chars accepts: NaN would compare
+// equal to every number.
+bool parse_float64(const char *begin, const char *end, double *out) {
+  auto res = std::from_chars(begin, end, *out);
+  return res.ec == std::errc() && res.ptr == end && std::isfinite(*out);
+}
 
-class manual_tuple_scan_iterator : public iterator {
- public:
-  manual_tuple_scan_iterator (vector<row_tuple> rows) :
-      rows(rows) {}
+// Parses exactly `n` digits.
+bool parse_fixed_digits(const char *p, int n, unsigned *out) {
+  unsigned v = 0;
+  for (int i = 0; i < n; i++) {
+    if (p[i] < '0' || p[i] > '9') {
+      return false;
+    }
+    v = v * 10 + static_cast<unsigned>(p[i] - '0');
+  }
+  *out = v;
+  return true;
+}
 
-  void init() {}
+// Parses YYYY-MM-DD.
+bool parse_date(const char *begin, const char *end, int64_t *days) {
+  unsigned y, m, d;
+  if (end - begin != 10 || begin[4] != '-' || begin[7] != '-' ||
+      !parse_fixed_digits(begin, 4, &y) || !parse_fixed_digits(begin + 5, 2, &m) ||
+      !parse_fixed_digits(begin + 8, 2, &d) ||
+      m < 1 || m > 12 || d < 1 || d > 31) {
+    return false;
+  }
+  *days = days_from_civil(y, m, d);
+  // A day past the end of its month (such as 02-30) rolls over.
+  int64_t check_y;
+  unsigned check_m, check_d;
+  civil_from_days(*days, &check_y, &check_m, &check_d);
+  return check_m == m && check_d == d;
+}
 
-  row_tuple next() {
-    if (this->rows_index >= this->rows.size()) {
-      return EOF_tuple;
-    }
+// Parses "YYYY-MM-DD HH:MM:SS" (or with a 'T' separator), as UTC.
+bool parse_timestamp(const char *begin, const char *end, int64_t *seconds) {
+  int64_t days;
+  unsigned h, m, s;
+  if (end - begin != 19 || (begin[10] != ' ' && begin[10] != 'T') ||
+      begin[13] != ':' || begin[16] != ':' ||
+      !parse_date(begin, begin + 10, &days) ||
+      !parse_fixed_digits(begin + 11, 2, &h) || !parse_fixed_digits(begin + 14, 2, &m) ||
+      !parse_fixed_digits(begin + 17, 2, &s) ||
+      h > 23 || m > 59 || s > 60) {
+    return false;
+  }
+  *seconds = days * 86400 + h * 3600 + m * 60 + s;
+  return true;
+}
 
-    auto next_tuple = this->rows[this->rows_index];
-    this->rows_index++;
+// Returns the narrowest type that `cell` parses as. Empty cells are null.
+value_type classify_cell(const string& cell) {
+  const char *begin = cell.data();
+  const char *end = begin + cell.size();
+  int64_t i;
+  double d;
+  if (cell.empty()) {
+    return value_type::null;
+  }
+  if (parse_int64(begin, end, &i)) {
+    return value_type::int64;
+  }
+  if (parse_float64(begin, end, &d)) {
+    return value_type::float64;
+  }
+  if (parse_date(begin, end, &i)) {
+    return value_type::date;
+  }
+  if (parse_timestamp(begin, end, &i)) {
+    return value_type::timestamp;
+  }
+  return value_type::string;
+}
 
-    return next_tuple;
+// Returns a type that can hold values of both `a` and `b`.
+value_type widen_type(value_type a, value_type b) {
+  if (a == value_type::null || a == b) {
+    return b;
+  }
+  if (b == value_type::null) {
+    return a;
   }
+  if ((a == value_type::int64 && b == value_type::float64) ||
+      (a == value_type::float64 && b == value_type::int64)) {
+    return value_type::float64;
+  }
+  return value_type::string;
+}
 
-  void close() {
-    this->rows_index = 0;
+// Parses the cell [begin, end) as `type`. Empty cells are null. Returns
+// false if the cell is malformed.
+bool parse_value(const char *begin, const char *end, value_type type, value *out) {
+  if (begin == end) {
+    *out = value();
+    return true;
+  }
+  switch (type) {
+    case value_type::null:
+      return false;
+    case value_type::int64: {
+      int64_t i;
+      if (!parse_int64(begin, end, &i)) return false;
+      *out = value(i);
+      return true;
+    }
+    case value_type::float64: {
+      double d;
+      if (!parse_float64(begin, end, &d)) return false;
+      *out = value(d);
+      return true;
+    }
+    case value_type::date: {
+      int64_t days;
+      if (!parse_date(begin, end, &days)) return false;
+      *out = value::date(days);
+      return true;
+    }
+    case value_type::timestamp: {
+      int64_t seconds;
+      if (!parse_timestamp(begin, end, &seconds)) return false;
+      *out = value::timestamp(seconds);
+      return true;
+    }
+    case value_type::string:
+      // Reuses the capacity of `out`'s string.
+      out->type = value_type::string;
+      out->i = 0;
+      out->d = 0;
+      out->s.assign(begin, end);
+      return true;
   }
+  return false;
+}
 
- private:
-  vector<row_tuple> rows;
-  std::size_t rows_index = 0;
-};
+bool parse_value(const string& cell, value_type type, value *out) {
+  return parse_value(cell.data(), cell.data() + cell.size(), type, out);
+}
 
-class selection_iterator : public iterator {
+class row_tuple {
  public:
-  selection_iterator (iterator *input, bool (*predicate)(row_tuple)) :
-      input(input), predicate(predicate) {}
+  row_tuple() : row_data({}) {}
+  row_tuple(unordered_map<string, value> row_data) :
+      row_data(std::move(row_data)) {}
 
-  void init() {
-    this->input->init();
-  }
+  unordered_map<string, value> row_data;
+};
 
-  row_tuple next() {
-    row_tuple t;
+inline bool operator==(const row_tuple& lhs, const row_tuple& rhs){
+  return lhs.row_data == rhs.row_data;
+}
+inline bool operator!=(const row_tuple& lhs, const row_tuple& rhs){ return !(lhs == rhs); }
 
-    while ( (t = this->input->next()) != EOF_tuple ) {
-      if (this->predicate(t)) {
-        return t;
-      }
+struct row_tuple_hash {
+  size_t operator()(const row_tuple& t) const {
+    // Column order in the map is arbitrary, so combine per-column hashes
+    // with an order-independent sum.
+    size_t h = 0;
+    for (const auto& p : t.row_data) {
+      h += std::hash<string>()(p.first) * 31 + value_hash()(p.second);
     }
+    return h;
+  }
+};
 
-    return EOF_tuple;
+// Drops the columns of `t` that `keep` rejects, if it has more than
+// `expected` columns. Operators that overwrite the cells of a reused
+// row in place call this afterwards, which costs nothing once the row
+// has settled on their columns.
+template <typename F>
+void drop_columns_beyond(size_t expected, F keep, row_tuple *t) {
+  if (t->row_data.size() <= expected) {
+    return;
   }
+  for (auto it = t->row_data.begin(); it != t->row_data.end(); ) {
+    it = keep(it->first) ? std::next(it) : t->row_data.erase(it);
+  }
+}
 
-  void close() {
-    this->input->close();
+// Makes `to` a copy of `from`, reusing the cells `to` already has.
+void assign_row(const row_tuple& from, row_tuple *to) {
+  for (const auto& p : from.row_data) {
+    to->row_data[p.first] = p.second;
   }
+  drop_columns_beyond(from.row_data.size(), [&from](const string& c) {
+      return from.row_data.count(c) > 0;
+    }, to);
+}
 
- private:
-  iterator *input;
-  bool (*predicate)(row_tuple);
-};
+// Sets `out` to the columns of `t0` and `t1`, reusing its cells.
+void join_tuples(const row_tuple& t0, const row_tuple& t1, row_tuple *out) {
+  for (const auto& p : t0.row_data) {
+    out->row_data[p.first] = p.second;
+  }
+  for (const auto& p: t1.row_data) {
+    // TODO: deal with col name collisions?
+    out->row_data[p.first] = p.second;
+  }
+  drop_columns_beyond(t0.row_data.size() + t1.row_data.size(), [&t0, &t1](const string& c) {
+      return t0.row_data.count(c) > 0 || t1.row_data.count(c) > 0;
+    }, out);
+}
 
-class projection_iterator : public iterator {
- public:
-  projection_iterator (iterator *input, vector<string> cols_to_project) :
-      input(input), cols_to_project(cols_to_project) {}
+// Mixes the bits of a hash (the splitmix64 finalizer), since std::hash
+// may be the identity for some types.
+inline uint64_t mix_hash(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
 
-  void init() {
-    this->input->init();
+// Bits of filter per inserted key; about a 1% false positive rate.
+const size_t kBloomBitsPerKey = 10;
+
+// A blocked Bloom filter: each key sets 8 bits, one in each 64-bit word
+// of a single cache-line-sized block, so a lookup touches one cache line
+// and can check all 8 words at once with AVX2.
+class bloom_filter {
+ public:
+  bloom_filter (size_t expected_keys) {
+    size_t blocks = std::max<size_t>(1, expected_keys * kBloomBitsPerKey / 512);
+    this->blocks.resize(blocks);
   }
 
-  row_tuple next() {
-    row_tuple t = this->input->next();
-    if (t == EOF_tuple) {
-      return EOF_tuple;
+  void insert(uint64_t hash) {
+    hash = mix_hash(hash);
+    auto& b = this->block_for(hash);
+    uint32_t key = static_cast<uint32_t>(hash);
+    for (int i = 0; i < 8; i++) {
+      b.words[i] |= uint64_t(1) << ((key * kSalts[i]) >> 26);
     }
+  }
 
-    unordered_map<string, string> row_tuple_data;
-    for (const auto& col_name : this->cols_to_project) {
-      row_tuple_data[col_name] = t.row_data[col_name];
+  bool may_contain(uint64_t hash) const {
+    hash = mix_hash(hash);
+    const auto& b = this->block_for(hash);
+    uint32_t key = static_cast<uint32_t>(hash);
+#ifdef __AVX2__
+    __m256i salts = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(kSalts));
+    __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(static_cast<int>(key)), salts), 26);
+    __m256i one = _mm256_set1_epi64x(1);
+    __m256i mask_lo = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(bits)));
+    __m256i mask_hi = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(bits, 1)));
+    __m256i words_lo = _mm256_load_si256(reinterpret_cast<const __m256i *>(b.words));
+    __m256i words_hi = _mm256_load_si256(reinterpret_cast<const __m256i *>(b.words + 4));
+    // testc is 1 when every bit of the mask is set in the words.
+    return _mm256_testc_si256(words_lo, mask_lo) & _mm256_testc_si256(words_hi, mask_hi);
+#else
+    uint64_t missing = 0;
+    for (int i = 0; i < 8; i++) {
+      missing |= ~b.words[i] & (uint64_t(1) << ((key * kSalts[i]) >> 26));
     }
+    return missing == 0;
+#endif
+  }
+
+ private:
+  struct alignas(64) block {
+    uint64_t words[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  };
 
-    return row_tuple(row_tuple_data);
+  // Odd multipliers picking the bit set in each word.
+  static constexpr uint32_t kSalts[8] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+
+  block& block_for(uint64_t hash) {
+    return this->blocks[((hash >> 32) * this->blocks.size()) >> 32];
   }
 
-  void close() {
-    this->input->close();
+  const block& block_for(uint64_t hash) const {
+    return this->blocks[((hash >> 32) * this->blocks.size()) >> 32];
   }
 
- private:
-  iterator *input;
-  vector<string> cols_to_project;
+  vector<block> blocks;
 };
 
-class average_iterator : public iterator {
+// A filter pushed by a join into its probe side: rows whose `cols` are
+// certainly not among the build side's join keys can be dropped as soon
+// as those columns are read.
+class runtime_filter {
  public:
-  average_iterator (iterator *input, string col_to_average, string aggregated_col_name = "average") :
-      input(input), col_to_average(col_to_average), aggregated_col_name(aggregated_col_name) {}
-
-  void init() {
-    this->input->init();
-  }
+  vector<string> cols;
+  std::shared_ptr<const bloom_filter> filter;
 
-  row_tuple next() {
-    if (done) {
-      return EOF_tuple;
+  bool may_match(const row_tuple& t) const {
+    // value_vector_hash of the key, without building the key.
+    static const value null_value;
+    size_t h = 0;
+    for (const auto& c : this->cols) {
+      auto it = t.row_data.find(c);
+      h = h * 31 + value_hash()(it == t.row_data.end() ? null_value : it->second);
     }
+    return this->filter->may_contain(h);
+  }
+};
 
-    row_tuple t;
-    int count = 0;
-    double sum = 0;
-    while ( (t = this->input->next()) != EOF_tuple) {
-      count++;
-      double data_as_double = std::stod(t.row_data[this->col_to_average]);
-      sum += data_as_double; // TODO check for overflows
+inline bool passes_runtime_filters(const vector<runtime_filter>& filters, const row_tuple& t) {
+  for (const auto& f : filters) {
+    if (!f.may_match(t)) {
+      return false;
     }
-
-    double avg = sum / static_cast<double>(count);
-
-    unordered_map<string, string> row_tuple_data =
-        {{this->aggregated_col_name, std::to_string(avg)}};
-
-    done = true;
-    return row_tuple(row_tuple_data);
   }
+  return true;
+}
 
-  void close() {
-    this->done = false;
-    this->input->close();
-  }
+const int64_t kNoMemoryLimit = -1;
 
- private:
-  iterator *input;
-  string col_to_average;
-  bool done = false;
-  string aggregated_col_name;
+// Thrown when a reservation would take a memory_tracker over its limit.
+// The query that hit it can be abandoned; the process carries on.
+class memory_limit_exceeded : public runtime_error {
+ public:
+  using runtime_error::runtime_error;
 };
 
-class sort_iterator : public iterator {
+string format_bytes(int64_t bytes) {
+  static const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+  double v = static_cast<double>(bytes);
+  int unit = 0;
+  while (std::abs(v) >= 1024 && unit < 4) {
+    v /= 1024;
+    unit++;
+  }
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), unit == 0 ? "%.0f %s" : "%.1f %s", v, units[unit]);
+  return buf;
+}
+
+// Counts the bytes held by the process, a query or an operator, in a
+// tree: reserving bytes charges the tracker and all of its ancestors,
+// and fails if any of them would go over its limit.
+class memory_tracker {
  public:
-  // Pass `col_to_sort: ""` to sort on all rows.
-  sort_iterator (iterator *input, string col_to_sort) :
-      input(input), col_to_sort(col_to_sort) {}
+  memory_tracker (string label, memory_tracker *parent = nullptr, int64_t limit = kNoMemoryLimit) :
+      label(label), parent(parent), limit(limit) {
+    if (this->parent != nullptr) {
+      std::lock_guard<std::mutex> lock(this->parent->children_mutex);
+      this->parent->children.push_back(this);
+    }
+  }
 
-  void init() {
-    this->input->init();
+  memory_tracker(const memory_tracker&) = delete;
+  memory_tracker& operator=(const memory_tracker&) = delete;
 
-    // Read all data into memory.
-    auto rows = new vector<row_tuple>();
-    row_tuple t;
-    while ( (t = this->input->next()) != EOF_tuple) {
-      rows->push_back(t);
+  ~memory_tracker() {
+    if (this->parent != nullptr) {
+      // Whatever is still reserved here is handed back by the ancestors.
+      this->parent->release(this->used.load());
+      std::lock_guard<std::mutex> lock(this->parent->children_mutex);
+      auto& siblings = this->parent->children;
+      siblings.erase(std::find(siblings.begin(), siblings.end(), this));
     }
+  }
 
-    auto col_to_sort = this->col_to_sort;
-
-    std::sort(rows->begin(), rows->end(), [&col_to_sort](row_tuple &a, row_tuple &b) {
-        // TODO: use const args
-        if (col_to_sort != "") {
-          return a.row_data[col_to_sort] < b.row_data[col_to_sort];
-        }
-        for ( const auto& n : a.row_data ) {
-          if (n.second < b.row_data[n.first]) {
-            return true;
-          } else if (n.second > b.row_data[n.first]) {
-            return false;
-          }
-          // if the values are equal, check the new col
+  // Throws memory_limit_exceeded, reserving nothing, if this or an
+  // ancestor would go over its limit.
+  void reserve(int64_t bytes) {
+    for (auto *t = this; t != nullptr; t = t->parent) {
+      if (!t->try_consume(bytes)) {
+        for (auto *u = this; u != t; u = u->parent) {
+          u->used -= bytes;
         }
-        // If the rows are equal, default to false
-        return false;
-      });
-
-    this->sorted_rows = rows;
+        throw memory_limit_exceeded(
+            "Memory limit exceeded: " + t->label + " is using " + format_bytes(t->bytes()) +
+            " of " + format_bytes(t->limit) + ", and " + this->label + " needs " +
+            format_bytes(bytes) + " more");
+      }
+    }
+    for (auto *t = this; t != nullptr; t = t->parent) {
+      int64_t now = t->used.load();
+      int64_t prev = t->peak.load();
+      while (now > prev && !t->peak.compare_exchange_weak(prev, now)) {
+      }
+    }
   }
 
-  row_tuple next() {
-    if (this->index >= this->sorted_rows->size()) {
-      return EOF_tuple;
+  void release(int64_t bytes) {
+    for (auto *t = this; t != nullptr; t = t->parent) {
+      t->used -= bytes;
     }
-
-    row_tuple next_tuple = (*this->sorted_rows)[this->index];
-    this->index++;
-    return next_tuple;
   }
 
-  void close() {
-    delete this->sorted_rows;
-    this->sorted_rows = nullptr;
-    this->index = 0;
-    this->input->close();
+  int64_t bytes() const { return this->used.load(); }
+  // The high-water mark of bytes().
+  int64_t peak_bytes() const { return this->peak.load(); }
+
+  // One line per tracker in this subtree, with usage, peak and limit.
+  string report(int depth = 0) const {
+    string out(2 * depth, ' ');
+    out += this->label + ": " + format_bytes(this->bytes()) + " (peak " +
+        format_bytes(this->peak_bytes());
+    if (this->limit != kNoMemoryLimit) {
+      out += ", limit " + format_bytes(this->limit);
+    }
+    out += ")\n";
+    std::lock_guard<std::mutex> lock(this->children_mutex);
+    for (const auto *child : this->children) {
+      out += child->report(depth + 1);
+    }
+    return out;
   }
+
+  string label;
+  memory_tracker *parent;
+  // Bytes, or kNoMemoryLimit. Set it before reserving from this tracker.
+  int64_t limit;
+
  private:
-  iterator *input;
-  string col_to_sort;
-  vector<row_tuple> *sorted_rows = nullptr;
-  size_t index = 0;
+  bool try_consume(int64_t bytes) {
+    int64_t now = this->used.fetch_add(bytes) + bytes;
+    if (this->limit != kNoMemoryLimit && bytes > 0 && now > this->limit) {
+      this->used -= bytes;
+      return false;
+    }
+    return true;
+  }
+
+  std::atomic<int64_t> used{0};
+  std::atomic<int64_t> peak{0};
+  mutable std::mutex children_mutex;
+  vector<memory_tracker *> children;
 };
 
-class distinct_iterator : public iterator {
+// The root of every memory_tracker tree. It has no limit unless one is
+// set.
+memory_tracker& process_memory_tracker() {
+  static memory_tracker tracker("process");
+  return tracker;
+}
+
+// Bytes an operator holds against a tracker (the process tracker by
+// default), given back on release() or destruction.
+class memory_reservation {
  public:
-  distinct_iterator (iterator *input) :
-      input(input) {}
+  memory_reservation() : tracker(&process_memory_tracker()) {}
+  memory_reservation(const memory_reservation&) = delete;
+  memory_reservation& operator=(const memory_reservation&) = delete;
+  ~memory_reservation() { this->release(); }
 
-  void init() {
-    this->input->init();
+  void set_tracker(memory_tracker *tracker) {
+    this->release();
+    this->tracker = tracker;
   }
 
-  row_tuple next() {
+  void grow(int64_t bytes) {
+    this->tracker->reserve(bytes);
+    this->bytes += bytes;
+  }
+
+  void release() {
+    this->tracker->release(this->bytes);
+    this->bytes = 0;
+  }
+
+  int64_t bytes = 0;
+
+ private:
+  memory_tracker *tracker;
+};
+
+// Rough heap footprint of a row held in a container, for memory
+// accounting.
+int64_t estimate_row_bytes(const row_tuple& t) {
+  // Strings longer than this are stored out of line.
+  const size_t kInlineStringCapacity = 15;
+  auto bytes = static_cast<int64_t>(sizeof(row_tuple) + t.row_data.bucket_count() * sizeof(void *));
+  for (const auto& p : t.row_data) {
+    // Each hash node holds the pair, a next pointer and the cached hash.
+    bytes += sizeof(p) + 2 * sizeof(void *);
+    if (p.first.capacity() > kInlineStringCapacity) {
+      bytes += p.first.capacity() + 1;
+    }
+    if (p.second.s.capacity() > kInlineStringCapacity) {
+      bytes += p.second.s.capacity() + 1;
+    }
+  }
+  return bytes;
+}
+
+class iterator {
+ public:
+  virtual ~iterator() {}
+  virtual void init() = 0;
+  // Reads the next row into `row` and returns true, or returns false at
+  // the end. Callers pass the same row to every call, and operators
+  // overwrite its cells in place, so that rows with the same columns
+  // flow through without allocating. `row` then has exactly this
+  // operator's columns.
+  virtual bool next(row_tuple *row) = 0;
+  virtual void close() = 0;
+
+  // Offers a runtime_filter to this iterator, to apply to the rows it
+  // returns or pass further down. Returns false if it was not taken.
+  // Called before init(); filters are dropped on close().
+  virtual bool push_runtime_filter(const runtime_filter& filter) { return false; }
+
+  // Charges the rows this iterator buffers (not those of its inputs) to
+  // `tracker` instead of the process tracker. Called before init().
+  virtual void track_memory(memory_tracker *tracker) {}
+};
+
+const int kMaxCSVLineLength = 100000;
+const size_t kCSVReadBlockSize = 65536;
+// Compressed bytes read from the file at a time.
+const size_t kCompressedReadBlockSize = 1 << 20;
+// zstd frames that decompress to more than this are decompressed as a
+// stream, a block at a time, instead of whole by a worker thread.
+const size_t kMaxBufferedZstdFrameBytes = 32 << 20;
+// Upper bound on the decompressed size of the zstd frames being
+// decompressed ahead of the reader.
+const size_t kMaxZstdBytesInFlight = 256 << 20;
+// Enough bytes to hold any zstd frame header.
+const size_t kMaxZstdFrameHeaderBytes = 18;
+
+// Counters describing how a scan read its file.
+class io_stats {
+ public:
+  // "stdio", "io_uring" or "pread".
+  string backend;
+  size_t bytes_read = 0;
+  size_t reads = 0;
+  // Time the reader spent blocked waiting for data from the file.
+  double io_wait_seconds = 0;
+};
+
+// How csv_scan_iterator reads its file.
+class io_options {
+ public:
+  // Keep `queue_depth` reads of `block_size` bytes in flight ahead of the
+  // parser (with io_uring, or a pool of pread threads if io_uring is not
+  // available). Otherwise, read synchronously through stdio.
+  bool async = true;
+  size_t queue_depth = 8;
+  size_t block_size = 512 << 10;
+  // Bypass the page cache with O_DIRECT, where the filesystem allows it.
+  bool direct = false;
+};
+
+// A source of (decompressed) bytes for csv_line_reader.
+class input_stream {
+ public:
+  virtual ~input_stream() {}
+
+  // Reads up to `n` bytes into `buf`. Returns 0 at the end of the stream.
+  virtual size_t read(char *buf, size_t n) = 0;
+
+  // Bytes returned by read() per byte read from the file so far.
+  virtual double compression_ratio() const { return 1; }
+
+  virtual io_stats stats() const = 0;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+class file_input_stream : public input_stream {
+ public:
+  file_input_stream (FILE *fp) :
+      fp(fp) {
+    this->io.backend = "stdio";
+  }
+
+  ~file_input_stream() {
+    std::fclose(this->fp);
+  }
+
+  size_t read(char *buf, size_t n) {
+    auto start = std::chrono::steady_clock::now();
+    size_t len = std::fread(buf, 1, n, this->fp);
+    this->io.io_wait_seconds += seconds_since(start);
+    if (len == 0 && std::ferror(this->fp)) {
+      throw runtime_error("CSV read failed");
+    }
+    this->io.bytes_read += len;
+    this->io.reads++;
+    return len;
+  }
+
+  io_stats stats() const { return this->io; }
+
+  void seek(size_t offset) {
+    if (std::fseek(this->fp, static_cast<long>(offset), SEEK_SET) != 0) {
+      throw runtime_error("CSV seek failed");
+    }
+  }
+
+ private:
+  FILE *fp;
+  io_stats io;
+};
+
+// A minimal io_uring submission/completion queue, driven directly
+// through the io_uring_setup/io_uring_enter system calls.
+class io_uring_queue {
+ public:
+  ~io_uring_queue() {
+    if (this->sqes != nullptr) {
+      munmap(this->sqes, this->sqes_size);
+    }
+    if (this->cq_ptr != nullptr && this->cq_ptr != this->sq_ptr) {
+      munmap(this->cq_ptr, this->cq_size);
+    }
+    if (this->sq_ptr != nullptr) {
+      munmap(this->sq_ptr, this->sq_size);
+    }
+    if (this->ring_fd >= 0) {
+      ::close(this->ring_fd);
+    }
+  }
+
+  // Returns false if io_uring is unavailable (old kernel, seccomp, ...).
+  bool setup(unsigned entries) {
+    struct io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    this->ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+    if (this->ring_fd < 0) {
+      return false;
+    }
+    this->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    this->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      this->sq_size = this->cq_size = std::max(this->sq_size, this->cq_size);
+    }
+    this->sq_ptr = this->map(this->sq_size, IORING_OFF_SQ_RING);
+    if (this->sq_ptr == nullptr) {
+      return false;
+    }
+    this->cq_ptr = single_mmap ? this->sq_ptr : this->map(this->cq_size, IORING_OFF_CQ_RING);
+    this->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    this->sqes = static_cast<struct io_uring_sqe *>(this->map(this->sqes_size, IORING_OFF_SQES));
+    if (this->cq_ptr == nullptr || this->sqes == nullptr) {
+      return false;
+    }
+    auto sq = static_cast<char *>(this->sq_ptr);
+    auto cq = static_cast<char *>(this->cq_ptr);
+    this->sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    this->sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    this->sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    this->cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    this->cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    this->cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    this->cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+    return true;
+  }
+
+  // Queues and submits a read of `len` bytes at `offset` into `buf`.
+  void submit_read(int fd, char *buf, size_t len, size_t offset, uint64_t user_data) {
+    unsigned tail = *this->sq_tail;
+    unsigned index = tail & this->sq_mask;
+    auto sqe = &this->sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = static_cast<unsigned>(len);
+    sqe->user_data = user_data;
+    this->sq_array[index] = index;
+    __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (syscall(__NR_io_uring_enter, this->ring_fd, 1, 0, 0, nullptr, 0) < 0) {
+      throw runtime_error(string("io_uring submit failed: ") + std::strerror(errno));
+    }
+  }
+
+  // Blocks until a read completes, returning its user_data and result
+  // (bytes read, or -errno).
+  void wait(uint64_t *user_data, int *res) {
+    while (true) {
+      unsigned head = *this->cq_head;
+      if (head != __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)) {
+        auto cqe = &this->cqes[head & this->cq_mask];
+        *user_data = cqe->user_data;
+        *res = cqe->res;
+        __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+        return;
+      }
+      if (syscall(__NR_io_uring_enter, this->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+          errno != EINTR) {
+        throw runtime_error(string("io_uring wait failed: ") + std::strerror(errno));
+      }
+    }
+  }
+
+ private:
+  void *map(size_t size, off_t offset) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring_fd, offset);
+    return p == MAP_FAILED ? nullptr : p;
+  }
+
+  int ring_fd = -1;
+  void *sq_ptr = nullptr;
+  void *cq_ptr = nullptr;
+  size_t sq_size = 0;
+  size_t cq_size = 0;
+  struct io_uring_sqe *sqes = nullptr;
+  size_t sqes_size = 0;
+  unsigned *sq_tail = nullptr;
+  unsigned sq_mask = 0;
+  unsigned *sq_array = nullptr;
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  struct io_uring_cqe *cqes = nullptr;
+};
+
+// Alignment of buffers, offsets and sizes for O_DIRECT reads.
+const size_t kDirectIOAlignment = 4096;
+
+// Reads a file with several large reads in flight ahead of the reader,
+// through io_uring when the kernel allows it and a pool of threads
+// calling pread otherwise.
+class async_file_input_stream : public input_stream {
+ public:
+  async_file_input_stream (const string& path, io_options options) :
+      options(options) {
+    this->options.queue_depth = std::max<size_t>(1, options.queue_depth);
+    this->options.block_size = (std::max<size_t>(1, options.block_size) + kDirectIOAlignment - 1) /
+        kDirectIOAlignment * kDirectIOAlignment;
+    this->fd = -1;
+    if (options.direct) {
+      this->fd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+    }
+    if (this->fd < 0) {
+      // Not every filesystem supports O_DIRECT.
+      this->fd = ::open(path.c_str(), O_RDONLY);
+    }
+    if (this->fd < 0) {
+      throw runtime_error("Could not open CSV with path: " + path);
+    }
+    struct stat st;
+    if (fstat(this->fd, &st) != 0) {
+      ::close(this->fd);
+      throw runtime_error("Could not stat CSV with path: " + path);
+    }
+    this->file_size = static_cast<size_t>(st.st_size);
+
+    this->slots.resize(this->options.queue_depth);
+    for (auto& slot : this->slots) {
+      void *p = nullptr;
+      if (posix_memalign(&p, kDirectIOAlignment, this->options.block_size) != 0) {
+        throw std::bad_alloc();
+      }
+      slot.buf = static_cast<char *>(p);
+    }
+
+    if (this->ring.setup(static_cast<unsigned>(this->options.queue_depth))) {
+      this->io.backend = "io_uring";
+      this->use_uring = true;
+    } else {
+      this->io.backend = "pread";
+      for (size_t i = 0; i < this->options.queue_depth; i++) {
+        this->workers.emplace_back([this]() { this->worker_loop(); });
+      }
+    }
+    for (size_t i = 0; i < this->slots.size(); i++) {
+      this->submit(i);
+    }
+  }
+
+  ~async_file_input_stream() {
+    if (this->use_uring) {
+      // Wait for reads still in flight before freeing their buffers.
+      for (auto& slot : this->slots) {
+        while (slot.in_flight) {
+          this->reap_one();
+        }
+      }
+    } else {
+      {
+        std::lock_guard<std::mutex> lock(this->mu);
+        this->stopping = true;
+      }
+      this->work_cv.notify_all();
+      for (auto& t : this->workers) {
+        t.join();
+      }
+    }
+    for (auto& slot : this->slots) {
+      free(slot.buf);
+    }
+    ::close(this->fd);
+  }
+
+  size_t read(char *buf, size_t n) {
+    while (true) {
+      auto& slot = this->slots[this->current];
+      if (slot.offset >= this->file_size) {
+        return 0;
+      }
+      this->wait_for(this->current);
+      if (this->pos < slot.len) {
+        size_t len = std::min(n, slot.len - this->pos);
+        std::memcpy(buf, slot.buf + this->pos, len);
+        this->pos += len;
+        return len;
+      }
+      // This block is used up: reuse its buffer for the next block.
+      this->pos = 0;
+      this->submit(this->current);
+      this->current = (this->current + 1) % this->slots.size();
+    }
+  }
+
+  io_stats stats() const { return this->io; }
+
+ private:
+  class slot_state {
+   public:
+    char *buf = nullptr;
+    size_t offset = 0;
+    size_t len = 0;
+    int error = 0;
+    bool in_flight = false;
+    // The read has completed.
+    bool ready = false;
+    // The read has completed, and was checked by wait_for().
+    bool checked = false;
+  };
+
+  // Starts reading the next block of the file into slot `i`.
+  void submit(size_t i) {
+    auto& slot = this->slots[i];
+    slot.offset = this->next_offset;
+    slot.len = 0;
+    slot.error = 0;
+    slot.ready = false;
+    slot.checked = false;
+    this->next_offset += this->options.block_size;
+    if (slot.offset >= this->file_size) {
+      return;
+    }
+    this->io.reads++;
+    slot.in_flight = true;
+    if (this->use_uring) {
+      this->ring.submit_read(this->fd, slot.buf, this->options.block_size, slot.offset, i);
+    } else {
+      {
+        std::lock_guard<std::mutex> lock(this->mu);
+        this->pending.push_back(i);
+      }
+      this->work_cv.notify_one();
+    }
+  }
+
+  void reap_one() {
+    uint64_t i;
+    int res;
+    this->ring.wait(&i, &res);
+    auto& slot = this->slots[i];
+    slot.in_flight = false;
+    slot.ready = true;
+    if (res < 0) {
+      slot.error = -res;
+    } else {
+      slot.len = static_cast<size_t>(res);
+    }
+  }
+
+  // Blocks until slot `i` holds its whole block.
+  void wait_for(size_t i) {
+    auto& slot = this->slots[i];
+    if (slot.checked) {
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (this->use_uring) {
+      while (!slot.ready) {
+        this->reap_one();
+      }
+    } else {
+      std::unique_lock<std::mutex> lock(this->mu);
+      this->done_cv.wait(lock, [&slot]() { return slot.ready; });
+    }
+    this->io.io_wait_seconds += seconds_since(start);
+    if (slot.error != 0) {
+      throw runtime_error(string("CSV read failed: ") + std::strerror(slot.error));
+    }
+    // Reads can come back short before the end of the file. The rest is
+    // read again from the last aligned position, as O_DIRECT requires.
+    size_t want = std::min(this->options.block_size, this->file_size - slot.offset);
+    while (slot.len < want) {
+      size_t done = slot.len / kDirectIOAlignment * kDirectIOAlignment;
+      auto res = pread(this->fd, slot.buf + done, this->options.block_size - done,
+                       static_cast<off_t>(slot.offset + done));
+      if (res < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw runtime_error(string("CSV read failed: ") + std::strerror(errno));
+      }
+      if (done + static_cast<size_t>(res) <= slot.len) {
+        throw runtime_error("CSV read failed: unexpected end of file");
+      }
+      slot.len = done + static_cast<size_t>(res);
+    }
+    slot.len = want;
+    slot.checked = true;
+    this->io.bytes_read += slot.len;
+  }
+
+  void worker_loop() {
+    while (true) {
+      size_t i;
+      {
+        std::unique_lock<std::mutex> lock(this->mu);
+        this->work_cv.wait(lock, [this]() { return this->stopping || !this->pending.empty(); });
+        if (this->stopping) {
+          return;
+        }
+        i = this->pending.front();
+        this->pending.pop_front();
+      }
+      auto& slot = this->slots[i];
+      auto res = pread(this->fd, slot.buf, this->options.block_size, static_cast<off_t>(slot.offset));
+      {
+        std::lock_guard<std::mutex> lock(this->mu);
+        if (res < 0) {
+          slot.error = errno;
+        } else {
+          slot.len = static_cast<size_t>(res);
+        }
+        slot.in_flight = false;
+        slot.ready = true;
+      }
+      this->done_cv.notify_all();
+    }
+  }
+
+  io_options options;
+  int fd;
+  size_t file_size = 0;
+  vector<slot_state> slots;
+  // The slot being read from, and the read position within it.
+  size_t current = 0;
+  size_t pos = 0;
+  size_t next_offset = 0;
+  io_stats io;
+
+  bool use_uring = false;
+  io_uring_queue ring;
+
+  std::mutex mu;
+  std::condition_variable work_cv;
+  std::condition_variable done_cv;
+  std::deque<size_t> pending;
+  bool stopping = false;
+  vector<std::thread> workers;
+};
+
+// Decompresses gzip (including concatenated gzip members, as written by
+// pigz) or zlib data as it is read.
+class gzip_input_stream : public input_stream {
+ public:
+  gzip_input_stream (std::unique_ptr<input_stream> source) :
+      source(std::move(source)), in(kCompressedReadBlockSize) {
+    std::memset(&this->zs, 0, sizeof(this->zs));
+    // 15 + 32: maximum window size, detect the gzip or zlib header.
+    if (inflateInit2(&this->zs, 15 + 32) != Z_OK) {
+      throw runtime_error("Could not initialize gzip decompression");
+    }
+  }
+
+  ~gzip_input_stream() {
+    inflateEnd(&this->zs);
+  }
+
+  size_t read(char *buf, size_t n) {
+    this->zs.next_out = reinterpret_cast<Bytef *>(buf);
+    this->zs.avail_out = static_cast<uInt>(n);
+    while (this->zs.avail_out == n && !this->done) {
+      if (this->zs.avail_in == 0) {
+        size_t len = this->source->read(this->in.data(), this->in.size());
+        if (len == 0) {
+          if (!this->at_member_start) {
+            throw runtime_error("Truncated gzip data");
+          }
+          this->done = true;
+          break;
+        }
+        this->raw_bytes += len;
+        this->zs.next_in = reinterpret_cast<Bytef *>(this->in.data());
+        this->zs.avail_in = static_cast<uInt>(len);
+      }
+      this->at_member_start = false;
+      int ret = inflate(&this->zs, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END) {
+        // Another member may follow.
+        inflateReset(&this->zs);
+        this->at_member_start = true;
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        throw runtime_error(string("gzip decompression failed: ") +
+                            (this->zs.msg != nullptr ? this->zs.msg : "unknown error"));
+      }
+    }
+    size_t produced = n - this->zs.avail_out;
+    this->out_bytes += produced;
+    return produced;
+  }
+
+  double compression_ratio() const {
+    size_t consumed = this->raw_bytes - this->zs.avail_in;
+    return consumed == 0 ? 1 : static_cast<double>(this->out_bytes) / static_cast<double>(consumed);
+  }
+
+  io_stats stats() const { return this->source->stats(); }
+
+ private:
+  std::unique_ptr<input_stream> source;
+  vector<char> in;
+  z_stream zs;
+  bool done = false;
+  bool at_member_start = true;
+  size_t raw_bytes = 0;
+  size_t out_bytes = 0;
+};
+
+// Decompresses zstd data. Files made of several frames (e.g. written by
+// `zstd --seekable` or `pzstd`) have their frames decompressed in
+// parallel, up to one frame per core and kMaxZstdBytesInFlight bytes
+// ahead of the reader, and returned in order. A frame that decompresses
+// to more than kMaxBufferedZstdFrameBytes, or does not record its size
+// (such as the single frame of a file compressed from a pipe), is
+// decompressed as a stream instead.
+class zstd_input_stream : public input_stream {
+ public:
+  zstd_input_stream (std::unique_ptr<input_stream> source) :
+      source(std::move(source)), max_in_flight(std::max(1u, std::thread::hardware_concurrency())) {}
+
+  ~zstd_input_stream() {
+    // Let workers finish before their inputs go away.
+    for (auto& f : this->in_flight) {
+      f.wait();
+    }
+    if (this->dctx != nullptr) {
+      ZSTD_freeDCtx(this->dctx);
+    }
+  }
+
+  size_t read(char *buf, size_t n) {
+    while (this->out_pos == this->out.size()) {
+      if (!this->next_output()) {
+        return 0;
+      }
+    }
+    size_t len = std::min(n, this->out.size() - this->out_pos);
+    std::memcpy(buf, this->out.data() + this->out_pos, len);
+    this->out_pos += len;
+    return len;
+  }
+
+  double compression_ratio() const {
+    return this->compressed_bytes == 0 ? 1 :
+        static_cast<double>(this->decompressed_bytes) / static_cast<double>(this->compressed_bytes);
+  }
+
+  io_stats stats() const { return this->source->stats(); }
+
+ private:
+  // Decompresses a whole frame whose header declares `size` bytes.
+  static string decompress_frame(const string& frame, size_t size) {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    string out(size, '\0');
+    auto ret = ZSTD_decompressDCtx(dctx, &out[0], out.size(), frame.data(), frame.size());
+    ZSTD_freeDCtx(dctx);
+    if (ZSTD_isError(ret)) {
+      throw runtime_error(string("zstd decompression failed: ") + ZSTD_getErrorName(ret));
+    }
+    out.resize(ret);
+    return out;
+  }
+
+  // Reads more compressed data into `in`. Returns false at the end of
+  // the file.
+  bool read_more() {
+    if (this->in_pos > 0) {
+      this->in.erase(0, this->in_pos);
+      this->in_pos = 0;
+    }
+    size_t old_size = this->in.size();
+    this->in.resize(old_size + kCompressedReadBlockSize);
+    size_t len = this->source->read(&this->in[old_size], kCompressedReadBlockSize);
+    this->in.resize(old_size + len);
+    return len > 0;
+  }
+
+  // Starts decompressing complete frames from `in` until enough are in
+  // flight, or stops at a frame that has to be streamed.
+  void submit_frames() {
+    while (!this->streaming && this->in_flight.size() < this->max_in_flight) {
+      size_t avail = this->in.size() - this->in_pos;
+      if (avail < kMaxZstdFrameHeaderBytes && !this->source_done) {
+        this->source_done = !this->read_more();
+        continue;
+      }
+      if (avail == 0) {
+        this->eof = true;
+        return;
+      }
+
+      const char *src = this->in.data() + this->in_pos;
+      auto size = ZSTD_getFrameContentSize(src, avail);
+      if (size == ZSTD_CONTENTSIZE_ERROR) {
+        throw runtime_error(avail < kMaxZstdFrameHeaderBytes ? "Truncated zstd data" : "Corrupt zstd frame header");
+      }
+      if (size == ZSTD_CONTENTSIZE_UNKNOWN || size > kMaxBufferedZstdFrameBytes) {
+        // Buffered frames resume once this one has been streamed.
+        this->streaming = true;
+        return;
+      }
+      if (!this->in_flight.empty() && this->in_flight_bytes + size > kMaxZstdBytesInFlight) {
+        return;
+      }
+
+      auto frame_size = ZSTD_findFrameCompressedSize(src, avail);
+      if (ZSTD_isError(frame_size)) {
+        if (ZSTD_getErrorCode(frame_size) != ZSTD_error_srcSize_wrong) {
+          throw runtime_error(string("zstd decompression failed: ") + ZSTD_getErrorName(frame_size));
+        }
+        // The frame is incomplete. A valid one is not much bigger than
+        // the data it holds.
+        if (avail > 2 * size + kCompressedReadBlockSize) {
+          throw runtime_error("zstd frame is larger than its declared size");
+        }
+        if (this->source_done || !this->read_more()) {
+          throw runtime_error("Truncated zstd data");
+        }
+        continue;
+      }
+      auto frame = std::make_shared<string>(src, frame_size);
+      this->in_pos += frame_size;
+      this->in_flight_sizes.push_back({frame_size, size});
+      this->in_flight_bytes += size;
+      this->in_flight.push_back(std::async(std::launch::async, [frame, size]() {
+            return decompress_frame(*frame, size);
+          }));
+    }
+  }
+
+  // Fills `out` with the next decompressed data. Returns false at the
+  // end of the stream.
+  bool next_output() {
+    this->out.clear();
+    this->out_pos = 0;
+    if (!this->eof) {
+      this->submit_frames();
+    }
+    if (!this->in_flight.empty()) {
+      this->out = this->in_flight.front().get();
+      this->in_flight.pop_front();
+      this->compressed_bytes += this->in_flight_sizes.front().first;
+      this->in_flight_bytes -= this->in_flight_sizes.front().second;
+      this->in_flight_sizes.pop_front();
+      this->decompressed_bytes += this->out.size();
+      return true;
+    }
+    if (!this->streaming) {
+      return false;
+    }
+
+    // Decompress the next piece of the streamed frame.
+    if (this->dctx == nullptr) {
+      this->dctx = ZSTD_createDCtx();
+    }
+    this->out.resize(ZSTD_DStreamOutSize());
+    ZSTD_outBuffer output = {&this->out[0], this->out.size(), 0};
+    while (output.pos == 0 && this->streaming) {
+      if (this->in_pos == this->in.size() && (this->source_done || !this->read_more())) {
+        throw runtime_error("Truncated zstd data");
+      }
+      ZSTD_inBuffer input = {this->in.data(), this->in.size(), this->in_pos};
+      auto ret = ZSTD_decompressStream(this->dctx, &output, &input);
+      if (ZSTD_isError(ret)) {
+        throw runtime_error(string("zstd decompression failed: ") + ZSTD_getErrorName(ret));
+      }
+      this->compressed_bytes += input.pos - this->in_pos;
+      this->in_pos = input.pos;
+      // 0: the frame is complete and flushed.
+      this->streaming = ret != 0;
+    }
+    this->out.resize(output.pos);
+    this->decompressed_bytes += output.pos;
+    return true;
+  }
+
+  std::unique_ptr<input_stream> source;
+  size_t max_in_flight;
+  string in;
+  size_t in_pos = 0;
+  std::deque<std::future<string> > in_flight;
+  // Compressed and decompressed size of each frame in `in_flight`.
+  std::deque<std::pair<size_t, size_t> > in_flight_sizes;
+  size_t in_flight_bytes = 0;
+  string out;
+  size_t out_pos = 0;
+  // The source has no more data.
+  bool source_done = false;
+  // All frames have been submitted.
+  bool eof = false;
+  // In the middle of a frame being streamed.
+  bool streaming = false;
+  ZSTD_DCtx *dctx = nullptr;
+  size_t compressed_bytes = 0;
+  size_t decompressed_bytes = 0;
+};
+
+// Opens `path`, decompressing gzip and zstd files (detected by their
+// magic bytes) transparently.
+std::unique_ptr<input_stream> open_input_stream(const string& path, const io_options& options) {
+  auto fp = std::fopen(path.c_str(), "rb");
+  if (fp == nullptr) {
+    throw runtime_error("Could not open CSV with path: " + path);
+  }
+  unsigned char magic[4] = {0, 0, 0, 0};
+  size_t len = std::fread(magic, 1, sizeof(magic), fp);
+  std::unique_ptr<input_stream> raw;
+  if (options.async) {
+    std::fclose(fp);
+    raw = std::make_unique<async_file_input_stream>(path, options);
+  } else {
+    std::rewind(fp);
+    raw = std::make_unique<file_input_stream>(fp);
+  }
+  if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    return std::make_unique<gzip_input_stream>(std::move(raw));
+  }
+  if (len == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+    return std::make_unique<zstd_input_stream>(std::move(raw));
+  }
+  return raw;
+}
+
+// Reads CSV records (which may contain quoted newlines) from a stream.
+// Unlike fread_csv_line, each reader owns its read buffer, so several
+// files can be scanned at the same time (e.g. both sides of a join).
+class csv_line_reader {
+ public:
+  csv_line_reader (input_stream *in) :
+      in(in), buf(kCSVReadBlockSize) {}
+
+  // Reads the next record, without its trailing newline, into `line`.
+  // Returns false at the end of the file.
+  bool read_line(string *line) {
+    line->clear();
+    bool in_quote = false;
+    bool got_data = false;
+    this->complete = false;
+    while (true) {
+      if (this->pos == this->len && !this->refill()) {
+        return got_data;
+      }
+      got_data = true;
+      const char *start = this->buf.data() + this->pos;
+      size_t avail = this->len - this->pos;
+      auto nl = static_cast<const char *>(std::memchr(start, '\n', avail));
+      size_t n = nl == nullptr ? avail : static_cast<size_t>(nl - start);
+      // Escaped quotes ("") toggle twice, so parity is enough.
+      in_quote ^= std::count(start, start + n, '"') % 2 == 1;
+      size_t take = nl == nullptr ? n : n + 1;
+      if (line->size() + take > static_cast<size_t>(kMaxCSVLineLength)) {
+        throw runtime_error("CSV line is longer than " + std::to_string(kMaxCSVLineLength) + " bytes");
+      }
+      this->pos += take;
+      this->consumed += take;
+      if (nl != nullptr && !in_quote) {
+        line->append(start, n);
+        this->complete = true;
+        return true;
+      }
+      line->append(start, take);
+    }
+  }
+
+  // Number of bytes of the file returned so far, including newlines.
+  size_t bytes_consumed() const { return this->consumed; }
+
+  // False if the last line returned ran into the end of the file before
+  // its newline (e.g. a row that is still being appended).
+  bool last_line_complete() const { return this->complete; }
+
+ private:
+  bool refill() {
+    this->pos = 0;
+    this->len = this->in->read(this->buf.data(), this->buf.size());
+    return this->len > 0;
+  }
+
+  input_stream *in;
+  vector<char> buf;
+  size_t pos = 0;
+  size_t len = 0;
+  size_t consumed = 0;
+  bool complete = false;
+};
+
+// A small key/value file holding the state of a continuously refreshed
+// query: how far each followed CSV has been read (see
+// csv_scan_iterator::follow) and the running state of aggregates (see
+// average_iterator::keep_running_state). Iterators update it on close();
+// save() then writes everything at once, so positions and aggregates
+// stay consistent with each other.
+class checkpoint_file {
+ public:
+  checkpoint_file (string path) :
+      path(path) {
+    auto fp = std::fopen(path.c_str(), "r");
+    if (fp == nullptr) {
+      return;
+    }
+    char buf[4096];
+    while (std::fgets(buf, sizeof(buf), fp) != nullptr) {
+      string line(buf);
+      if (!line.empty() && line.back() == '\n') {
+        line.pop_back();
+      }
+      auto tab = line.find('\t');
+      if (tab != string::npos) {
+        this->entries[line.substr(0, tab)] = line.substr(tab + 1);
+      }
+    }
+    std::fclose(fp);
+  }
+
+  bool has(const string& key) const { return this->entries.count(key) > 0; }
+
+  string get(const string& key) const {
+    auto it = this->entries.find(key);
+    return it == this->entries.end() ? "" : it->second;
+  }
+
+  void set(const string& key, const string& value) {
+    this->entries[key] = value;
+  }
+
+  // Atomically replaces the file with the current entries.
+  void save() const {
+    string tmp = this->path + ".tmp";
+    auto fp = std::fopen(tmp.c_str(), "w");
+    if (fp == nullptr) {
+      throw runtime_error("Could not write checkpoint: " + tmp);
+    }
+    for (const auto& e : this->entries) {
+      std::fprintf(fp, "%s\t%s\n", e.first.c_str(), e.second.c_str());
+    }
+    bool ok = std::fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = std::fclose(fp) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), this->path.c_str()) != 0) {
+      throw runtime_error("Could not write checkpoint: " + this->path);
+    }
+  }
+
+ private:
+  string path;
+  unordered_map<string, string> entries;
+};
+
+// Rows per row_batch.
+const size_t kRowBatchSize = 1024;
+
+// A cell of a row_batch: [begin, end) in its text. Quoted cells still
+// have their CSV quotes.
+class cell_span {
+ public:
+  uint32_t begin;
+  uint32_t end;
+  bool quoted;
+};
+
+// Removes CSV quoting from [begin, end) the way parse_csv does.
+void unquote_csv_cell(const char *begin, const char *end, string *out) {
+  out->clear();
+  bool in_quotes = false;
+  for (const char *p = begin; p < end; p++) {
+    if (*p != '"') {
+      out->push_back(*p);
+    } else if (!in_quotes) {
+      in_quotes = true;
+    } else if (p + 1 < end && p[1] == '"') {
+      out->push_back('"');
+      p++;
+    } else {
+      in_quotes = false;
+    }
+  }
+}
+
+// Splits a CSV line into cells without copying them. Returns false if a
+// quote is not closed.
+bool split_csv_cells(const char *begin, const char *end, vector<cell_span> *cells) {
+  cells->clear();
+  const char *start = begin;
+  bool in_quotes = false;
+  bool quoted = false;
+  for (const char *p = begin; ; p++) {
+    if (p == end || (*p == ',' && !in_quotes)) {
+      if (p == end && in_quotes) {
+        return false;
+      }
+      cells->push_back({static_cast<uint32_t>(start - begin), static_cast<uint32_t>(p - begin), quoted});
+      if (p == end) {
+        return true;
+      }
+      start = p + 1;
+      quoted = false;
+    } else if (*p == '"') {
+      quoted = true;
+      if (in_quotes && p + 1 < end && p[1] == '"') {
+        p++;
+      } else {
+        in_quotes = !in_quotes;
+      }
+    }
+  }
+}
+
+// A batch of scanned rows whose cells are kept as raw text until an
+// operator reads them, so that columns nobody reads are never parsed or
+// copied. Rows are addressed by id, their position in the batch.
+class row_batch {
+ public:
+  // Set by the scan; shared by all of its batches.
+  const vector<string> *columns = nullptr;
+  const vector<value_type> *types = nullptr;
+  string source;
+
+  // Ids of the rows that are still live, in order.
+  vector<uint32_t> selection;
+  // Indexes into `columns` of the columns that are output, in order.
+  vector<size_t> visible;
+
+  size_t num_rows = 0;
+  string text;
+  // columns->size() cells per row, into `text`.
+  vector<cell_span> cells;
+  // For error messages.
+  vector<size_t> row_numbers;
+
+  void clear() {
+    this->selection.clear();
+    this->visible.clear();
+    this->num_rows = 0;
+    this->text.clear();
+    this->cells.clear();
+    this->row_numbers.clear();
+  }
+
+  size_t column_index(const string& name) const {
+    auto it = std::find(this->columns->begin(), this->columns->end(), name);
+    if (it == this->columns->end()) {
+      throw runtime_error("No column " + name + " in " + this->source);
+    }
+    return static_cast<size_t>(it - this->columns->begin());
+  }
+
+  // Parses one cell into `v`.
+  void get(uint32_t row, size_t col, value *v) const {
+    const auto& cell = this->cells[row * this->columns->size() + col];
+    const char *begin = this->text.data() + cell.begin;
+    const char *end = this->text.data() + cell.end;
+    string unquoted;
+    if (cell.quoted) {
+      unquote_csv_cell(begin, end, &unquoted);
+      begin = unquoted.data();
+      end = begin + unquoted.size();
+    }
+    if (!parse_value(begin, end, (*this->types)[col], v)) {
+      throw runtime_error(
+          "CSV " + this->source + " row " + std::to_string(this->row_numbers[row]) +
+          ": could not parse column '" + (*this->columns)[col] + "' value '" +
+          string(begin, end) + "' as " + value_type_name((*this->types)[col]));
+    }
+  }
+
+  value get(uint32_t row, size_t col) const {
+    value v;
+    this->get(row, col, &v);
+    return v;
+  }
+
+  // Sets `out` to the columns `cols` of a row, reusing its cells.
+  void materialize(uint32_t row, const vector<size_t>& cols, row_tuple *out) const {
+    for (auto c : cols) {
+      this->get(row, c, &out->row_data[(*this->columns)[c]]);
+    }
+    drop_columns_beyond(cols.size(), [this, &cols](const string& name) {
+        return std::any_of(cols.begin(), cols.end(), [&](size_t c) { return (*this->columns)[c] == name; });
+      }, out);
+  }
+
+  // Adds a row from the cells of `line` at positions `cols`.
+  void add_row(const string& line, const vector<cell_span>& line_cells,
+               const vector<size_t>& cols, size_t row_number) {
+    auto base = static_cast<uint32_t>(this->text.size());
+    this->text += line;
+    for (auto c : cols) {
+      auto cell = line_cells[c];
+      this->cells.push_back({base + cell.begin, base + cell.end, cell.quoted});
+    }
+    this->row_numbers.push_back(row_number);
+    this->selection.push_back(static_cast<uint32_t>(this->num_rows));
+    this->num_rows++;
+  }
+};
+
+// The batch counterpart of iterator, for operators that pass row_batches
+// along instead of building a row_tuple per row.
+class batch_iterator {
+ public:
+  virtual ~batch_iterator() {}
+  virtual void init() = 0;
+  // Refills `batch`. Returns false at the end.
+  virtual bool next_batch(row_batch *batch) = 0;
+  virtual void close() = 0;
+
+  // As for iterator.
+  virtual bool push_runtime_filter(const runtime_filter& filter) { return false; }
+};
+
+// Number of rows read at init() to infer column types.
+const size_t kSchemaInferenceSampleRows = 1000;
+// Bytes per block for csv_scan_iterator::sample_blocks().
+const size_t kSampleBlockSize = 1 << 16;
+
+class csv_scan_iterator : public iterator, public batch_iterator {
+ public:
+  // `column_types` gives the type of each header. If it is empty, the
+  // types are inferred from the first kSchemaInferenceSampleRows rows.
+  csv_scan_iterator (string path, vector<string> headers, vector<value_type> column_types = {},
+                     io_options options = io_options()) :
+      path(path), headers(headers), column_types(column_types), options(options) {
+    if (!column_types.empty() && column_types.size() != headers.size()) {
+      throw runtime_error("CSV schema must have one type per header: " + path);
+    }
+  }
+
+  // Switches to follow mode, for files that are only ever appended to:
+  // each init() continues after the last complete row read before the
+  // previous close(), and a row without its newline yet is left for the
+  // next time. With a checkpoint, the position is kept there too and
+  // survives restarts. Compressed files cannot be followed.
+  void follow(checkpoint_file *checkpoint = nullptr) {
+    this->following = true;
+    this->checkpoint = checkpoint;
+    if (checkpoint != nullptr && checkpoint->has(this->checkpoint_key())) {
+      this->resume_offset = std::stoull(checkpoint->get(this->checkpoint_key()));
+    }
+  }
+
+  // Switches to block sampling: the file is cut into `block_size` byte
+  // blocks and each is read, whole, with probability `fraction`; the
+  // others are skipped without being read. Rows are kept or dropped
+  // together with their neighbours, so estimates have more variance than
+  // from a row-level sample of the same size. Rows belong to the block
+  // where they start; a block starting inside a quoted cell with a
+  // newline in it may be misread. Compressed files cannot be sampled.
+  void sample_blocks(double fraction, uint64_t seed = 0, size_t block_size = kSampleBlockSize) {
+    if (this->following) {
+      throw runtime_error("Cannot block-sample a followed CSV: " + this->path);
+    }
+    this->block_fraction = fraction;
+    this->block_seed = seed;
+    this->block_size = std::max<size_t>(block_size, 1);
+  }
+
+  void init() {
+    // Read the headers from the first line of the CSV
+    if (this->following) {
+      this->open_seekable("follow");
+    } else if (this->block_fraction < 1) {
+      this->open_seekable("block-sample");
+    } else {
+      this->in = open_input_stream(this->path, this->options);
+    }
+    this->reader = std::make_unique<csv_line_reader>(this->in.get());
+
+    vector<size_t> headers_to_csv_cols;
+    string line;
+    if (!this->reader->read_line(&line)) {
+      throw runtime_error("CSV has no data: " + this->path);
+    }
+    char **parsed = parse_csv(line.c_str());
+    if (parsed == nullptr) {
+      throw runtime_error("CSV reading error: " + this->path);
+    }
+    char **parsed_start = parsed;
+
+    // Get all headers from the csv
+    vector<string> csv_headers;
+    for ( ; *parsed != nullptr ; parsed++ ) {
+      auto s = string(*parsed);
+      absl::AsciiStrToLower(&s);
+      csv_headers.push_back(s);
+    }
+
+    for (const auto& h : headers) {
+      auto found = false;
+      // This is O(n^2), but n should be small (hopefully smaller
+      // than the overhead of creating a map?).
+      for (size_t i = 0; i < csv_headers.size(); i++) {
+        auto ch = csv_headers[i];
+        if (h == ch) {
+          found = true;
+          headers_to_csv_cols.push_back(i);
+          break;
+        }
+      }
+      if (!found) {
+        throw runtime_error("Could not find header: " + h + "\n");
+      }
+    }
+    this->headers_to_csv_cols = headers_to_csv_cols;
+    this->line_number = 1;
+    this->header_bytes = this->reader->bytes_consumed();
+
+    free_csv_line(parsed_start);
+
+    this->types = this->column_types;
+    if (this->following) {
+      this->resume_followed();
+    } else if (this->block_fraction < 1) {
+      this->start_block_sampling();
+    } else if (this->types.empty()) {
+      this->infer_types();
+    }
+  }
+
+  bool next(row_tuple *row) {
+    auto& fields = this->fields;
+    while (true) {
+      if (this->sample_index < this->sample_rows.size()) {
+        fields = std::move(this->sample_rows[this->sample_index]);
+        this->sample_index++;
+        this->row_number++;
+        if (!this->passes_runtime_filters([&fields](size_t i) {
+              return std::make_pair(fields[i].data(), fields[i].data() + fields[i].size());
+            })) {
+          this->rows_rejected++;
+          continue;
+        }
+      } else if (!this->read_fields(&fields)) {
+        return false;
+      }
+      break;
+    }
+
+    for (size_t i = 0; i < this->headers.size(); i++) {
+      if (!parse_value(fields[i], this->types[i], &row->row_data[this->headers[i]])) {
+        throw runtime_error(
+            "CSV " + this->path + " row " + std::to_string(this->row_number) +
+            ": could not parse column '" + this->headers[i] + "' value '" +
+            fields[i] + "' as " + value_type_name(this->types[i]));
+      }
+    }
+    drop_columns_beyond(this->headers.size(), [this](const string& c) {
+        return std::find(this->headers.begin(), this->headers.end(), c) != this->headers.end();
+      }, row);
+    return true;
+  }
+
+  // Fills `batch` with up to kRowBatchSize rows, keeping the cells of
+  // the lines read as they are until they are read from the batch.
+  // Cannot be mixed with next() within one init() and close().
+  bool next_batch(row_batch *batch) {
+    batch->clear();
+    batch->columns = &this->headers;
+    batch->types = &this->types;
+    batch->source = this->path;
+    for (size_t i = 0; i < this->headers.size(); i++) {
+      batch->visible.push_back(i);
+    }
+    auto& all_cols = this->all_cols;
+    all_cols = batch->visible;
+    while (batch->num_rows < kRowBatchSize) {
+      if (this->sample_index < this->sample_rows.size()) {
+        // Sampled rows are already split and unquoted.
+        auto& fields = this->sample_rows[this->sample_index];
+        this->sample_index++;
+        this->row_number++;
+        if (!this->passes_runtime_filters([&fields](size_t i) {
+              return std::make_pair(fields[i].data(), fields[i].data() + fields[i].size());
+            })) {
+          this->rows_rejected++;
+          continue;
+        }
+        this->line.clear();
+        this->line_cells.clear();
+        for (const auto& f : fields) {
+          auto begin = static_cast<uint32_t>(this->line.size());
+          this->line += f;
+          this->line_cells.push_back({begin, static_cast<uint32_t>(this->line.size()), false});
+        }
+        batch->add_row(this->line, this->line_cells, all_cols, this->row_number);
+        continue;
+      }
+      if (!this->read_data_line()) {
+        break;
+      }
+      if (!split_csv_cells(this->line.data(), this->line.data() + this->line.size(), &this->line_cells)) {
+        throw runtime_error("CSV " + this->path + " line " + std::to_string(this->line_number) +
+                            ": could not parse line");
+      }
+      this->check_column_count(this->line_cells.size());
+      this->row_number++;
+      if (!this->passes_runtime_filters([this](size_t i) { return this->cell_text(i); })) {
+        this->rows_rejected++;
+        continue;
+      }
+      batch->add_row(this->line, this->line_cells, this->headers_to_csv_cols, this->row_number);
+    }
+    return batch->num_rows > 0;
+  }
+
+  // Bytes of data rows (excluding the header line) read from the file so
+  // far, including rows buffered for type inference.
+  size_t data_bytes_read() const {
+    return this->reader->bytes_consumed() - this->header_bytes;
+  }
+
+  // Decompressed bytes per byte of the file read so far.
+  double compression_ratio() const { return this->in->compression_ratio(); }
+
+  // How the file has been read since init().
+  io_stats stats() const { return this->in->stats(); }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    vector<size_t> cols;
+    for (const auto& c : filter.cols) {
+      auto it = std::find(this->headers.begin(), this->headers.end(), c);
+      if (it == this->headers.end()) {
+        return false;
+      }
+      cols.push_back(static_cast<size_t>(it - this->headers.begin()));
+    }
+    this->runtime_filters.push_back(filter);
+    this->runtime_filter_cols.push_back(cols);
+    return true;
+  }
+
+  // Rows dropped by runtime filters since init().
+  size_t rows_rejected_by_runtime_filters() const { return this->rows_rejected; }
+
+  // The column types in use, after inference. Valid after init().
+  const vector<value_type>& types_in_use() const { return this->types; }
+
+  void close() {
+    if (this->following && this->checkpoint != nullptr) {
+      this->checkpoint->set(this->checkpoint_key(), std::to_string(this->resume_offset));
+    }
+    this->reader.reset();
+    this->in.reset();
+    this->is_done = false;
+    this->headers_to_csv_cols = {};
+    this->sample_rows = {};
+    this->sample_index = 0;
+    this->row_number = 0;
+    this->runtime_filters.clear();
+    this->runtime_filter_cols.clear();
+    this->rows_rejected = 0;
+  }
+
+ private:
+  // Reads the next line and extracts the requested columns from it.
+  // Returns false at the end of the file.
+  // The strings in `fields` are reused.
+  bool read_fields(vector<string> *fields) {
+    while (true) {
+      if (!this->read_data_line()) {
+        return false;
+      }
+      if (!split_csv_cells(this->line.data(), this->line.data() + this->line.size(), &this->line_cells)) {
+        throw runtime_error("CSV " + this->path + " line " + std::to_string(this->line_number) +
+                            ": could not parse line");
+      }
+      this->check_column_count(this->line_cells.size());
+      if (!this->inferring) {
+        this->row_number++;
+        // Check the join keys before copying or parsing anything else.
+        if (!this->passes_runtime_filters([this](size_t i) { return this->cell_text(i); })) {
+          this->rows_rejected++;
+          continue;
+        }
+      }
+      fields->resize(this->headers.size());
+      for (size_t i = 0; i < this->headers.size(); i++) {
+        auto cell = this->cell_text(i);
+        (*fields)[i].assign(cell.first, cell.second);
+      }
+      return true;
+    }
+  }
+
+  // The [begin, end) text of the i-th requested column of `line`, after
+  // split_csv_cells(). Quoted cells are unquoted into a scratch string
+  // that the next call overwrites.
+  std::pair<const char *, const char *> cell_text(size_t i) {
+    const auto& cell = this->line_cells[this->headers_to_csv_cols[i]];
+    const char *begin = this->line.data() + cell.begin;
+    const char *end = this->line.data() + cell.end;
+    if (cell.quoted) {
+      unquote_csv_cell(begin, end, &this->unquoted_cell);
+      const char *u = this->unquoted_cell.data();
+      return std::make_pair(u, u + this->unquoted_cell.size());
+    }
+    return std::make_pair(begin, end);
+  }
+
+  // Reads the next non-blank line into `line`. Returns false at the end
+  // of the file, or at a row without its newline yet when following.
+  bool read_data_line() {
+    if (this->is_done) {
+      return false;
+    }
+    do {
+      if (this->block_fraction < 1 && !this->enter_sampled_block()) {
+        this->is_done = true;
+        return false;
+      }
+      if (!this->reader->read_line(&this->line) ||
+          (this->following && !this->reader->last_line_complete())) {
+        this->is_done = true;
+        return false;
+      }
+      this->line_number++;
+      if (this->following) {
+        this->resume_offset = this->followed_base + this->reader->bytes_consumed();
+      }
+      // Skip blank lines.
+    } while (this->line.empty());
+    return true;
+  }
+
+  // Throws if a line with `n` cells lacks a requested column.
+  void check_column_count(size_t n) const {
+    for (size_t i = 0; i < this->headers.size(); i++) {
+      if (this->headers_to_csv_cols[i] >= n) {
+        throw runtime_error("CSV " + this->path + " line " + std::to_string(this->line_number) +
+                            ": missing column '" + this->headers[i] + "'");
+      }
+    }
+  }
+
+  // Returns false if a runtime filter rejects the row whose i-th column
+  // is the cell `cell(i)` (a [begin, end) pair). Only key columns are
+  // parsed.
+  template <typename F>
+  bool passes_runtime_filters(F cell) {
+    for (size_t f = 0; f < this->runtime_filters.size(); f++) {
+      // value_vector_hash of the key, without building the key.
+      size_t h = 0;
+      for (auto i : this->runtime_filter_cols[f]) {
+        auto c = cell(i);
+        if (!parse_value(c.first, c.second, this->types[i], &this->filter_cell)) {
+          // Let next() report the malformed cell.
+          return true;
+        }
+        h = h * 31 + value_hash()(this->filter_cell);
+      }
+      if (!this->runtime_filters[f].filter->may_contain(h)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  string checkpoint_key() const { return "csv_offset:" + this->path; }
+
+  void open_seekable(const string& why) {
+    auto fp = std::fopen(this->path.c_str(), "rb");
+    if (fp == nullptr) {
+      throw runtime_error("Could not open CSV with path: " + this->path);
+    }
+    unsigned char magic[2] = {0, 0};
+    size_t len = std::fread(magic, 1, sizeof(magic), fp);
+    std::rewind(fp);
+    if (len == 2 && ((magic[0] == 0x1f && magic[1] == 0x8b) || (magic[0] == 0x28 && magic[1] == 0xb5))) {
+      std::fclose(fp);
+      throw runtime_error("Cannot " + why + " a compressed CSV: " + this->path);
+    }
+    this->in = std::make_unique<file_input_stream>(fp);
+  }
+
+  // Called by init() in follow mode, after the header has been read:
+  // moves to where the previous scan stopped.
+  void resume_followed() {
+    this->infer_types_from_start();
+    struct stat st;
+    if (stat(this->path.c_str(), &st) != 0) {
+      throw runtime_error("Could not stat CSV with path: " + this->path);
+    }
+    if (static_cast<size_t>(st.st_size) < this->resume_offset) {
+      throw runtime_error("Followed CSV is shorter than its last read position (was it replaced?): " +
+                          this->path);
+    }
+    this->resume_offset = std::max(this->resume_offset, this->header_bytes);
+    static_cast<file_input_stream *>(this->in.get())->seek(this->resume_offset);
+    this->reader = std::make_unique<csv_line_reader>(this->in.get());
+    this->followed_base = this->resume_offset;
+  }
+
+  // Infers types once, from the start of the file, for scans that do not
+  // read it in order. They then do not change between init()s.
+  void infer_types_from_start() {
+    if (!this->types.empty()) {
+      return;
+    }
+    if (this->start_types.empty()) {
+      io_options sync;
+      sync.async = false;
+      csv_scan_iterator sampler(this->path, this->headers, {}, sync);
+      sampler.init();
+      this->start_types = sampler.types_in_use();
+      sampler.close();
+    }
+    this->types = this->start_types;
+  }
+
+  // Called by init() when block sampling, after the header has been read.
+  void start_block_sampling() {
+    this->infer_types_from_start();
+    struct stat st;
+    if (stat(this->path.c_str(), &st) != 0) {
+      throw runtime_error("Could not stat CSV with path: " + this->path);
+    }
+    this->file_size = static_cast<size_t>(st.st_size);
+    this->block_rng.seed(this->block_seed);
+    // Ends the (empty) block before block 0, so the first row read picks
+    // the first sampled block.
+    this->block_index = -1;
+    this->block_end = this->header_bytes;
+    this->block_base = 0;
+  }
+
+  // Moves the reader, if the next line starts past the current block, to
+  // the first line of the next sampled block. Returns false if there is
+  // none.
+  bool enter_sampled_block() {
+    std::geometric_distribution<int64_t> skip(std::max(this->block_fraction, 1e-9));
+    while (this->block_base + this->reader->bytes_consumed() >= this->block_end) {
+      size_t line_start = this->block_base + this->reader->bytes_consumed();
+      int64_t next = this->block_index + 1 + skip(this->block_rng);
+      size_t start = this->header_bytes + static_cast<size_t>(next) * this->block_size;
+      if (start >= this->file_size) {
+        return false;
+      }
+      this->block_index = next;
+      this->block_end = start + this->block_size;
+      if (line_start >= start) {
+        // The block was reached by reading on from the previous one.
+        continue;
+      }
+      // Seek to just before the block, and drop the rest of the line
+      // there; if that byte is a newline, nothing is dropped.
+      static_cast<file_input_stream *>(this->in.get())->seek(start - 1);
+      this->reader = std::make_unique<csv_line_reader>(this->in.get());
+      this->block_base = start - 1;
+      if (!this->reader->read_line(&this->line)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Buffers a sample of rows (returned by next() before reading any more
+  // of the file) and picks the narrowest type that fits each column.
+  void infer_types() {
+    this->types.assign(this->headers.size(), value_type::null);
+    // Types are not known yet, so runtime filters are applied as the
+    // sample is returned by next().
+    this->inferring = true;
+    vector<string> fields;
+    while (this->sample_rows.size() < kSchemaInferenceSampleRows &&
+           this->read_fields(&fields)) {
+      for (size_t i = 0; i < fields.size(); i++) {
+        this->types[i] = widen_type(this->types[i], classify_cell(fields[i]));
+      }
+      this->sample_rows.push_back(fields);
+    }
+    for (auto& type : this->types) {
+      if (type == value_type::null) {
+        // Every sampled cell was empty.
+        type = value_type::string;
+      }
+    }
+    this->inferring = false;
+  }
+
+  string path;
+  vector<string> headers;
+  vector<value_type> column_types;
+  io_options options;
+  std::unique_ptr<input_stream> in;
+  std::unique_ptr<csv_line_reader> reader;
+  string line;
+  // Cells of `line` and a scratch cell.
+  vector<cell_span> line_cells;
+  string unquoted_cell;
+  // The requested cells of the current row, for next().
+  vector<string> fields;
+  // Every column's index, for next_batch().
+  vector<size_t> all_cols;
+  size_t header_bytes = 0;
+  vector<size_t> headers_to_csv_cols;
+  vector<value_type> types;
+
+  vector<vector<string> > sample_rows;
+  size_t sample_index = 0;
+  bool inferring = false;
+  size_t line_number = 0;
+  size_t row_number = 0;
+
+  vector<runtime_filter> runtime_filters;
+  // Indexes into `headers` of each runtime filter's columns.
+  vector<vector<size_t> > runtime_filter_cols;
+  value filter_cell;
+  size_t rows_rejected = 0;
+
+  bool following = false;
+  checkpoint_file *checkpoint = nullptr;
+  // Inferred from the start of the file, when following or block
+  // sampling.
+  vector<value_type> start_types;
+  // File offset where the reader started, and just past the last
+  // complete row read.
+  size_t followed_base = 0;
+  size_t resume_offset = 0;
+
+  double block_fraction = 1;
+  uint64_t block_seed = 0;
+  size_t block_size = 0;
+  std::mt19937_64 block_rng;
+  size_t file_size = 0;
+  int64_t block_index = 0;
+  // File offset of the reader's start, and the end of the current block.
+  size_t block_base = 0;
+  size_t block_end = 0;
+
+  bool is_done = false;
+};
+
+// At most this many files of a dataset_scan_iterator are open (and read
+// in parallel) at once, unless the caller asks for another limit.
+const size_t kDatasetOpenFiles = 4;
+// Rows handed from the file readers to next() at a time, and how many
+// such chunks may wait in the queue before the readers block.
+const size_t kDatasetChunkRows = 1024;
+const size_t kDatasetQueueChunks = 16;
+// Hive's name for the partition that holds null values.
+const char kNullPartition[] = "__HIVE_DEFAULT_PARTITION__";
+
+// One file of a partitioned dataset.
+class dataset_file {
+ public:
+  string path;
+  size_t bytes = 0;
+  // The key=value directory names above the file, with lowercased keys
+  // and %XX escapes decoded.
+  vector<std::pair<string, string> > partitions;
+};
+
+string decode_partition_value(const string& s) {
+  string out;
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned c;
+    if (s[i] == '%' && i + 2 < s.size() &&
+        std::sscanf(s.substr(i + 1, 2).c_str(), "%2x", &c) == 1) {
+      out += static_cast<char>(c);
+      i += 2;
+    } else {
+      out += s[i];
+    }
+  }
+  return out;
+}
+
+// Adds the key=value segments of `relative` (a path below the dataset's
+// root) to `file`.
+void parse_partition_path(const string& relative, dataset_file *file) {
+  size_t start = 0;
+  while (true) {
+    size_t slash = relative.find('/', start);
+    if (slash == string::npos) {
+      // The last segment is the file name.
+      return;
+    }
+    string segment = relative.substr(start, slash - start);
+    size_t eq = segment.find('=');
+    if (eq != string::npos && eq > 0) {
+      string key = segment.substr(0, eq);
+      absl::AsciiStrToLower(&key);
+      file->partitions.push_back({key, decode_partition_value(segment.substr(eq + 1))});
+    }
+    start = slash + 1;
+  }
+}
+
+// Files and directories whose names start with '.' or '_' (such as
+// _SUCCESS markers) are not part of a dataset.
+bool hidden_dataset_entry(const string& name) {
+  return name.empty() || name[0] == '.' || name[0] == '_';
+}
+
+void list_dataset_directory(const string& root, const string& relative, vector<dataset_file> *files) {
+  string dir = relative.empty() ? root : root + "/" + relative;
+  DIR *d = opendir(dir.c_str());
+  if (d == nullptr) {
+    throw runtime_error("Could not list dataset directory: " + dir);
+  }
+  vector<string> names;
+  while (struct dirent *entry = readdir(d)) {
+    string name = entry->d_name;
+    if (!hidden_dataset_entry(name)) {
+      names.push_back(name);
+    }
+  }
+  closedir(d);
+  std::sort(names.begin(), names.end());
+  for (const auto& name : names) {
+    string rel = relative.empty() ? name : relative + "/" + name;
+    struct stat st;
+    if (stat((root + "/" + rel).c_str(), &st) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      list_dataset_directory(root, rel, files);
+    } else if (S_ISREG(st.st_mode)) {
+      dataset_file f;
+      f.path = root + "/" + rel;
+      f.bytes = static_cast<size_t>(st.st_size);
+      parse_partition_path(rel, &f);
+      files->push_back(std::move(f));
+    }
+  }
+}
+
+// Lists the files of the dataset at `path`: a single file, a directory
+// (searched recursively) or a glob pattern. Partition values come from
+// key=value directories below the directory, or below the last
+// directory of a glob pattern without wildcards.
+vector<dataset_file> list_dataset_files(const string& path) {
+  vector<dataset_file> files;
+  size_t wildcard = path.find_first_of("*?[");
+  if (wildcard != string::npos) {
+    size_t root_end = path.rfind('/', wildcard);
+    size_t root_len = root_end == string::npos ? 0 : root_end + 1;
+    glob_t g;
+    int rc = glob(path.c_str(), 0, nullptr, &g);
+    if (rc != 0 && rc != GLOB_NOMATCH) {
+      throw runtime_error("Could not expand dataset pattern: " + path);
+    }
+    for (size_t i = 0; rc == 0 && i < g.gl_pathc; i++) {
+      string match = g.gl_pathv[i];
+      struct stat st;
+      if (stat(match.c_str(), &st) != 0) {
+        continue;
+      }
+      if (S_ISDIR(st.st_mode)) {
+        size_t before = files.size();
+        list_dataset_directory(match, "", &files);
+        // The matched directory names may hold partition values too.
+        dataset_file prefix;
+        parse_partition_path(match.substr(root_len) + "/", &prefix);
+        for (size_t j = before; j < files.size(); j++) {
+          files[j].partitions.insert(files[j].partitions.begin(),
+                                     prefix.partitions.begin(), prefix.partitions.end());
+        }
+      } else if (S_ISREG(st.st_mode)) {
+        dataset_file f;
+        f.path = match;
+        f.bytes = static_cast<size_t>(st.st_size);
+        parse_partition_path(match.substr(root_len), &f);
+        files.push_back(std::move(f));
+      }
+    }
+    globfree(&g);
+    return files;
+  }
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    throw runtime_error("Could not find dataset: " + path);
+  }
+  if (S_ISDIR(st.st_mode)) {
+    list_dataset_directory(path, "", &files);
+  } else {
+    dataset_file f;
+    f.path = path;
+    f.bytes = static_cast<size_t>(st.st_size);
+    files.push_back(std::move(f));
+  }
+  return files;
+}
+
+// A filter on partition columns only, which can skip whole files.
+class partition_filter {
+ public:
+  bool (*predicate)(const row_tuple&) = nullptr;
+  vector<string> cols;
+};
+
+// Scans the CSV files of a partitioned dataset (see list_dataset_files)
+// as one table. `headers` may name partition columns as well as CSV
+// columns; the CSV columns must be in every file. Files are read by up
+// to `max_open_files` threads at once, each with one file open, so rows
+// from different files come out interleaved.
+class dataset_scan_iterator : public iterator {
+ public:
+  // `column_types` gives the type of each header. If it is empty, the
+  // partition columns' types are inferred from all their values, and the
+  // CSV columns' from the first file that is read.
+  dataset_scan_iterator (string path, vector<string> headers, vector<value_type> column_types = {},
+                         io_options options = io_options(), size_t max_open_files = kDatasetOpenFiles) :
+      path(path), headers(headers), column_types(column_types), options(options),
+      max_open_files(std::max<size_t>(max_open_files, 1)) {
+    if (!column_types.empty() && column_types.size() != headers.size()) {
+      throw runtime_error("Dataset schema must have one type per header: " + path);
+    }
+  }
+
+  ~dataset_scan_iterator() {
+    this->stop_readers();
+  }
+
+  // Skips the files whose partition values fail `predicate`. Every
+  // column in `cols` must be a partition column.
+  void add_partition_filter(bool (*predicate)(const row_tuple&), vector<string> cols) {
+    this->partition_filters.push_back({predicate, cols});
+  }
+
+  // The partition columns, in the order they first appear in the paths.
+  vector<string> partition_columns() {
+    this->list_files();
+    return this->partition_keys;
+  }
+
+  // The files left after the partition filters, listed afresh.
+  vector<dataset_file> matching_files() {
+    this->list_files();
+    vector<dataset_file> matched;
+    for (size_t i = 0; i < this->files.size(); i++) {
+      if (this->file_matches(i)) {
+        matched.push_back(this->files[i]);
+      }
+    }
+    return matched;
+  }
+
+  // Files found by the last listing, before pruning.
+  size_t files_listed() const { return this->files.size(); }
+
+  // Files skipped by the partition filters in the last init().
+  size_t files_pruned() const { return this->pruned; }
+
+  // The partition columns' values for a file of the last listing.
+  row_tuple partition_values_of(const string& file_path) const {
+    for (size_t i = 0; i < this->files.size(); i++) {
+      if (this->files[i].path == file_path) {
+        return this->partition_values[i];
+      }
+    }
+    throw runtime_error("Not a file of " + this->path + ": " + file_path);
+  }
+
+  void init() {
+    this->stop_readers();
+    this->list_files();
+    this->to_read.clear();
+    for (size_t i = 0; i < this->files.size(); i++) {
+      if (this->file_matches(i)) {
+        this->to_read.push_back(i);
+      }
+    }
+    this->pruned = this->files.size() - this->to_read.size();
+
+    this->csv_headers.clear();
+    this->csv_types.clear();
+    for (size_t i = 0; i < this->headers.size(); i++) {
+      if (this->partition_index(this->headers[i]) == string::npos) {
+        this->csv_headers.push_back(this->headers[i]);
+        if (!this->column_types.empty()) {
+          this->csv_types.push_back(this->column_types[i]);
+        }
+      }
+    }
+    // Every file must be parsed with the same types, so infer them once.
+    if (this->csv_types.empty() && !this->csv_headers.empty() && !this->to_read.empty()) {
+      io_options sync;
+      sync.async = false;
+      csv_scan_iterator sampler(this->files[this->to_read[0]].path, this->csv_headers, {}, sync);
+      sampler.init();
+      this->csv_types = sampler.types_in_use();
+      sampler.close();
+    }
+
+    this->next_file = 0;
+    this->chunks.clear();
+    this->chunk = {};
+    this->chunk_index = 0;
+    this->error = nullptr;
+    this->stopping = false;
+    size_t readers = std::min(this->max_open_files, this->to_read.size());
+    this->active_readers = readers;
+    for (size_t i = 0; i < readers; i++) {
+      this->readers.emplace_back([this] { this->read_files(); });
+    }
+  }
+
+  bool next(row_tuple *row) {
+    while (true) {
+      if (this->chunk_index < this->chunk.size()) {
+        // The caller's old row goes back to the readers with the chunk,
+        // to be refilled in place.
+        std::swap(*row, this->chunk[this->chunk_index++]);
+        return true;
+      }
+      std::unique_lock<std::mutex> lock(this->mu);
+      if (!this->chunk.empty()) {
+        this->free_chunks.push_back(std::move(this->chunk));
+        this->chunk.clear();
+      }
+      this->chunk_ready.wait(lock, [this] {
+        return !this->chunks.empty() || this->active_readers == 0 || this->error != nullptr;
+      });
+      if (this->error != nullptr) {
+        std::rethrow_exception(this->error);
+      }
+      if (this->chunks.empty()) {
+        return false;
+      }
+      this->chunk = std::move(this->chunks.front());
+      this->chunks.pop_front();
+      this->chunk_index = 0;
+      this->queue_space.notify_one();
+    }
+  }
+
+  // Filters on CSV columns go down to each file's scan; the rest are
+  // checked as rows leave the readers.
+  bool push_runtime_filter(const runtime_filter& filter) {
+    this->runtime_filters.push_back(filter);
+    return true;
+  }
+
+  void close() {
+    this->stop_readers();
+    this->chunks.clear();
+    this->free_chunks.clear();
+    this->chunk = {};
+    this->chunk_index = 0;
+    this->runtime_filters.clear();
+  }
+
+ private:
+  void list_files() {
+    this->files = list_dataset_files(this->path);
+    this->partition_keys.clear();
+    for (const auto& f : this->files) {
+      for (const auto& p : f.partitions) {
+        if (this->partition_index(p.first) == string::npos) {
+          this->partition_keys.push_back(p.first);
+        }
+      }
+    }
+    // A column that is given a type keeps it; the others take the
+    // narrowest type that holds all of their values.
+    vector<value_type> key_types(this->partition_keys.size(), value_type::null);
+    for (size_t k = 0; k < this->partition_keys.size(); k++) {
+      auto h = std::find(this->headers.begin(), this->headers.end(), this->partition_keys[k]);
+      if (h != this->headers.end() && !this->column_types.empty()) {
+        key_types[k] = this->column_types[h - this->headers.begin()];
+        continue;
+      }
+      for (const auto& f : this->files) {
+        for (const auto& p : f.partitions) {
+          if (p.first == this->partition_keys[k] && p.second != kNullPartition) {
+            key_types[k] = widen_type(key_types[k], classify_cell(p.second));
+          }
+        }
+      }
+      if (key_types[k] == value_type::null) {
+        key_types[k] = value_type::string;
+      }
+    }
+    // Files without a partition column hold nulls in it.
+    this->partition_values.assign(this->files.size(), {});
+    for (size_t i = 0; i < this->files.size(); i++) {
+      auto& values = this->partition_values[i];
+      for (const auto& key : this->partition_keys) {
+        values.row_data[key] = value();
+      }
+      for (const auto& p : this->files[i].partitions) {
+        size_t k = this->partition_index(p.first);
+        value v;
+        if (p.second != kNullPartition && !parse_value(p.second, key_types[k], &v)) {
+          throw runtime_error("Bad value for partition column " + p.first + ": " + this->files[i].path);
+        }
+        values.row_data[p.first] = v;
+      }
+    }
+  }
+
+  size_t partition_index(const string& col) const {
+    auto it = std::find(this->partition_keys.begin(), this->partition_keys.end(), col);
+    return it == this->partition_keys.end() ? string::npos : it - this->partition_keys.begin();
+  }
+
+  bool file_matches(size_t i) {
+    for (const auto& f : this->partition_filters) {
+      for (const auto& c : f.cols) {
+        if (this->partition_index(c) == string::npos) {
+          throw runtime_error("Not a partition column of " + this->path + ": " + c);
+        }
+      }
+      if (!f.predicate(this->partition_values[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Runs on each reader thread until the files run out or close() is
+  // called. An exception is handed to next().
+  void read_files() {
+    try {
+      while (!this->stopping) {
+        size_t n = this->next_file.fetch_add(1);
+        if (n >= this->to_read.size()) {
+          break;
+        }
+        if (!this->read_file(this->to_read[n])) {
+          break;
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(this->mu);
+      if (this->error == nullptr) {
+        this->error = std::current_exception();
+      }
+    }
+    std::lock_guard<std::mutex> lock(this->mu);
+    this->active_readers--;
+    this->chunk_ready.notify_all();
+  }
+
+  // Returns false if the scan was stopped.
+  bool read_file(size_t file) {
+    const auto& values = this->partition_values[file].row_data;
+    auto keep = [this](const string& c) {
+      return std::find(this->headers.begin(), this->headers.end(), c) != this->headers.end();
+    };
+    vector<row_tuple> rows = this->take_free_chunk();
+    size_t n = 0;
+    if (this->csv_headers.empty()) {
+      // Only partition columns: every record is a row with the same values.
+      auto in = open_input_stream(this->files[file].path, this->options);
+      csv_line_reader reader(in.get());
+      string line;
+      bool header = true;
+      while (reader.read_line(&line)) {
+        if (header || line.empty() || line == "\r") {
+          header = false;
+          continue;
+        }
+        auto& t = row_slot(&rows, n);
+        for (const auto& h : this->headers) {
+          t.row_data[h] = values.at(h);
+        }
+        drop_columns_beyond(this->headers.size(), keep, &t);
+        if (!this->emit(&rows, &n, this->runtime_filters)) {
+          return false;
+        }
+      }
+      return this->flush(&rows, n);
+    }
+
+    csv_scan_iterator scan(this->files[file].path, this->csv_headers, this->csv_types, this->options);
+    vector<runtime_filter> unpushed;
+    for (const auto& f : this->runtime_filters) {
+      if (!scan.push_runtime_filter(f)) {
+        unpushed.push_back(f);
+      }
+    }
+    scan.init();
+    // Cells are swapped rather than copied from the scan's row into the
+    // chunk's, so both keep their storage.
+    row_tuple scanned;
+    while (scan.next(&scanned)) {
+      auto& t = row_slot(&rows, n);
+      for (auto& p : scanned.row_data) {
+        std::swap(t.row_data[p.first], p.second);
+      }
+      for (const auto& h : this->headers) {
+        auto v = values.find(h);
+        if (v != values.end()) {
+          t.row_data[h] = v->second;
+        }
+      }
+      drop_columns_beyond(this->headers.size(), keep, &t);
+      if (!this->emit(&rows, &n, unpushed)) {
+        scan.close();
+        return false;
+      }
+    }
+    scan.close();
+    return this->flush(&rows, n);
+  }
+
+  // The `n`-th row of a chunk being filled.
+  static row_tuple& row_slot(vector<row_tuple> *rows, size_t n) {
+    if (n == rows->size()) {
+      rows->emplace_back();
+    }
+    return (*rows)[n];
+  }
+
+  // Keeps the row just filled at `*n` if it passes `filters`, and queues
+  // the chunk once it is full.
+  bool emit(vector<row_tuple> *rows, size_t *n, const vector<runtime_filter>& filters) {
+    if (!passes_runtime_filters(filters, (*rows)[*n])) {
+      return true;
+    }
+    ++*n;
+    if (*n < kDatasetChunkRows) {
+      return true;
+    }
+    bool queued = this->flush(rows, *n);
+    *rows = this->take_free_chunk();
+    *n = 0;
+    return queued;
+  }
+
+  // Queues the first `n` rows of `rows`, waiting for space. Returns
+  // false if the scan was stopped.
+  bool flush(vector<row_tuple> *rows, size_t n) {
+    if (n == 0) {
+      return !this->stopping;
+    }
+    rows->resize(n);
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->queue_space.wait(lock, [this] {
+      return this->chunks.size() < kDatasetQueueChunks || this->stopping;
+    });
+    if (this->stopping) {
+      return false;
+    }
+    this->chunks.push_back(std::move(*rows));
+    rows->clear();
+    this->chunk_ready.notify_one();
+    return true;
+  }
+
+  // A chunk that next() has finished with, so that its rows are reused.
+  vector<row_tuple> take_free_chunk() {
+    std::lock_guard<std::mutex> lock(this->mu);
+    if (this->free_chunks.empty()) {
+      return {};
+    }
+    auto rows = std::move(this->free_chunks.back());
+    this->free_chunks.pop_back();
+    return rows;
+  }
+
+  void stop_readers() {
+    {
+      std::lock_guard<std::mutex> lock(this->mu);
+      this->stopping = true;
+      this->queue_space.notify_all();
+    }
+    for (auto& t : this->readers) {
+      t.join();
+    }
+    this->readers.clear();
+  }
+
+  string path;
+  vector<string> headers;
+  vector<value_type> column_types;
+  io_options options;
+  size_t max_open_files;
+  vector<partition_filter> partition_filters;
+
+  vector<dataset_file> files;
+  vector<string> partition_keys;
+  // The partition columns' values for each file.
+  vector<row_tuple> partition_values;
+  vector<size_t> to_read;
+  size_t pruned = 0;
+  vector<string> csv_headers;
+  vector<value_type> csv_types;
+  vector<runtime_filter> runtime_filters;
+
+  vector<std::thread> readers;
+  std::atomic<size_t> next_file{0};
+  std::mutex mu;
+  std::condition_variable chunk_ready;
+  std::condition_variable queue_space;
+  std::deque<vector<row_tuple> > chunks;
+  vector<vector<row_tuple> > free_chunks;
+  size_t active_readers = 0;
+  std::atomic<bool> stopping{false};
+  std::exception_ptr error;
+
+  vector<row_tuple> chunk;
+  size_t chunk_index = 0;
+};
+
+class manual_tuple_scan_iterator : public iterator {
+ public:
+  manual_tuple_scan_iterator (vector<row_tuple> rows) :
+      rows(rows) {}
+
+  void init() {}
+
+  bool next(row_tuple *row) {
+    while (this->rows_index < this->rows.size()) {
+      auto& t = this->rows[this->rows_index];
+      this->rows_index++;
+      if (passes_runtime_filters(this->runtime_filters, t)) {
+        assign_row(t, row);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void close() {
+    this->rows_index = 0;
+    this->runtime_filters.clear();
+  }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    this->runtime_filters.push_back(filter);
+    return true;
+  }
+
+ private:
+  vector<row_tuple> rows;
+  std::size_t rows_index = 0;
+  vector<runtime_filter> runtime_filters;
+};
+
+class selection_iterator : public iterator {
+ public:
+  selection_iterator (iterator *input, bool (*predicate)(const row_tuple&)) :
+      input(input), predicate(predicate) {}
+
+  void init() {
+    this->input->init();
+  }
+
+  bool next(row_tuple *row) {
+    while (this->input->next(row)) {
+      if (passes_runtime_filters(this->runtime_filters, *row) && this->predicate(*row)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void close() {
+    this->input->close();
+    this->runtime_filters.clear();
+  }
+
+  // Applies runtime filters itself if the input cannot.
+  bool push_runtime_filter(const runtime_filter& filter) {
+    if (!this->input->push_runtime_filter(filter)) {
+      this->runtime_filters.push_back(filter);
+    }
+    return true;
+  }
+
+ private:
+  iterator *input;
+  bool (*predicate)(const row_tuple&);
+  vector<runtime_filter> runtime_filters;
+};
+
+class projection_iterator : public iterator {
+ public:
+  projection_iterator (iterator *input, vector<string> cols_to_project) :
+      input(input), cols_to_project(cols_to_project) {}
+
+  void init() {
+    this->input->init();
+  }
+
+  bool next(row_tuple *row) {
+    if (!this->input->next(&this->input_row)) {
+      return false;
+    }
+    for (const auto& col_name : this->cols_to_project) {
+      std::swap(row->row_data[col_name], this->input_row.row_data[col_name]);
+    }
+    drop_columns_beyond(this->cols_to_project.size(), [this](const string& c) {
+        return std::find(this->cols_to_project.begin(), this->cols_to_project.end(), c) !=
+            this->cols_to_project.end();
+      }, row);
+    return true;
+  }
+
+  void close() {
+    this->input->close();
+    this->input_row = row_tuple();
+  }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    return this->input->push_runtime_filter(filter);
+  }
+
+ private:
+  iterator *input;
+  vector<string> cols_to_project;
+  row_tuple input_row;
+};
+
+// selection_iterator over batches: only `predicate_cols`, which must be
+// every column the predicate reads, are parsed, and rows that fail are
+// dropped from the selection without being copied.
+class batch_selection_iterator : public batch_iterator {
+ public:
+  batch_selection_iterator (batch_iterator *input, bool (*predicate)(const row_tuple&),
+                            vector<string> predicate_cols) :
+      input(input), predicate(predicate), predicate_cols(predicate_cols) {}
+
+  void init() {
+    this->input->init();
+  }
+
+  bool next_batch(row_batch *batch) {
+    while (this->input->next_batch(batch)) {
+      auto& cols = this->cols;
+      cols.clear();
+      for (const auto& c : this->predicate_cols) {
+        cols.push_back(batch->column_index(c));
+      }
+      size_t kept = 0;
+      for (auto row : batch->selection) {
+        batch->materialize(row, cols, &this->row);
+        if (this->predicate(this->row)) {
+          batch->selection[kept++] = row;
+        }
+      }
+      batch->selection.resize(kept);
+      if (kept > 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void close() {
+    this->input->close();
+  }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    return this->input->push_runtime_filter(filter);
+  }
+
+ private:
+  batch_iterator *input;
+  bool (*predicate)(const row_tuple&);
+  vector<string> predicate_cols;
+  vector<size_t> cols;
+  // Holds the predicate columns of each row in turn.
+  row_tuple row;
+};
+
+// projection_iterator over batches: narrows the visible columns.
+class batch_projection_iterator : public batch_iterator {
+ public:
+  batch_projection_iterator (batch_iterator *input, vector<string> cols_to_project) :
+      input(input), cols_to_project(cols_to_project) {}
+
+  void init() {
+    this->input->init();
+  }
+
+  bool next_batch(row_batch *batch) {
+    if (!this->input->next_batch(batch)) {
+      return false;
+    }
+    batch->visible.clear();
+    for (const auto& c : this->cols_to_project) {
+      batch->visible.push_back(batch->column_index(c));
+    }
+    return true;
+  }
+
+  void close() {
+    this->input->close();
+  }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    return this->input->push_runtime_filter(filter);
+  }
+
+ private:
+  batch_iterator *input;
+  vector<string> cols_to_project;
+};
+
+// Turns batches back into rows, parsing only the visible columns of the
+// selected rows.
+class materialize_iterator : public iterator {
+ public:
+  materialize_iterator (batch_iterator *input) :
+      input(input) {}
+
+  void init() {
+    this->input->init();
+  }
+
+  bool next(row_tuple *row) {
+    while (true) {
+      if (this->index >= this->batch.selection.size()) {
+        if (!this->input->next_batch(&this->batch)) {
+          return false;
+        }
+        this->index = 0;
+        continue;
+      }
+      this->batch.materialize(this->batch.selection[this->index], this->batch.visible, row);
+      this->index++;
+      if (passes_runtime_filters(this->runtime_filters, *row)) {
+        return true;
+      }
+    }
+  }
+
+  void close() {
+    this->input->close();
+    this->batch.clear();
+    this->index = 0;
+    this->runtime_filters.clear();
+  }
+
+  // Applies runtime filters itself if the input cannot.
+  bool push_runtime_filter(const runtime_filter& filter) {
+    if (!this->input->push_runtime_filter(filter)) {
+      this->runtime_filters.push_back(filter);
+    }
+    return true;
+  }
+
+ private:
+  batch_iterator *input;
+  row_batch batch;
+  size_t index = 0;
+  vector<runtime_filter> runtime_filters;
+};
+
+class average_iterator : public iterator {
+ public:
+  average_iterator (iterator *input, string col_to_average, string aggregated_col_name = "average") :
+      input(input), col_to_average(col_to_average), aggregated_col_name(aggregated_col_name) {}
+
+  // Keeps the sum and count across close() and init(), so that over an
+  // input that only returns new rows each time (a followed
+  // csv_scan_iterator) the average covers every row seen so far. With a
+  // checkpoint, the state is kept there under `key` too.
+  void keep_running_state(checkpoint_file *checkpoint = nullptr, string key = "") {
+    this->running = true;
+    this->checkpoint = checkpoint;
+    this->checkpoint_key = "average:" + (key == "" ? this->col_to_average : key);
+    if (checkpoint != nullptr && checkpoint->has(this->checkpoint_key)) {
+      auto state = checkpoint->get(this->checkpoint_key);
+      auto space = state.find(' ');
+      this->sum = std::stod(state.substr(0, space));
+      this->count = std::stoll(state.substr(space + 1));
+    }
+  }
+
+  void init() {
+    this->input->init();
+  }
+
+  bool next(row_tuple *row) {
+    if (done) {
+      return false;
+    }
+
+    if (!this->running) {
+      this->count = 0;
+      this->sum = 0;
+    }
+    row_tuple t;
+    while (this->input->next(&t)) {
+      const auto& v = t.row_data[this->col_to_average];
+      if (v.is_null()) {
+        continue;
+      }
+      this->count++;
+      this->sum += v.as_double(); // TODO check for overflows
+    }
+
+    double avg = this->sum / static_cast<double>(this->count);
+
+    row->row_data = {{this->aggregated_col_name, avg}};
+
+    done = true;
+    return true;
+  }
+
+  void close() {
+    this->done = false;
+    this->input->close();
+    if (this->running && this->checkpoint != nullptr) {
+      this->checkpoint->set(this->checkpoint_key,
+                            value(this->sum).to_string() + " " + std::to_string(this->count));
+    }
+  }
+
+ private:
+  iterator *input;
+  string col_to_average;
+  bool done = false;
+  string aggregated_col_name;
+
+  int64_t count = 0;
+  double sum = 0;
+  bool running = false;
+  checkpoint_file *checkpoint = nullptr;
+  string checkpoint_key;
+};
+
+// Passes each row with probability `fraction`.
+class bernoulli_sample_iterator : public iterator {
+ public:
+  bernoulli_sample_iterator (iterator *input, double fraction, uint64_t seed = 0) :
+      input(input), fraction(fraction), seed(seed) {}
+
+  void init() {
+    this->input->init();
+    this->rng.seed(this->seed);
+    this->skip = this->next_skip();
+  }
+
+  bool next(row_tuple *row) {
+    while (this->input->next(row)) {
+      if (this->skip > 0) {
+        this->skip--;
+        continue;
+      }
+      this->skip = this->next_skip();
+      return true;
+    }
+    return false;
+  }
+
+  void close() {
+    this->input->close();
+  }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    return this->input->push_runtime_filter(filter);
+  }
+
+ private:
+  // Rows to drop before the next one kept, so that the generator runs
+  // once per sampled row rather than once per row.
+  int64_t next_skip() {
+    if (this->fraction >= 1) {
+      return 0;
+    }
+    if (this->fraction <= 0) {
+      return std::numeric_limits<int64_t>::max();
+    }
+    return std::geometric_distribution<int64_t>(this->fraction)(this->rng);
+  }
+
+  iterator *input;
+  double fraction;
+  uint64_t seed;
+  std::mt19937_64 rng;
+  int64_t skip = 0;
+};
+
+// A uniform sample of `capacity` rows from a stream of unknown length
+// (Li's algorithm L, which skips ahead instead of drawing per row).
+// Samples of disjoint streams, e.g. one per thread, can be merged into a
+// uniform sample of their union.
+class reservoir_sample {
+ public:
+  reservoir_sample (size_t capacity, uint64_t seed = 0) :
+      capacity(capacity), rng(seed) {
+    this->w = std::exp(std::log(this->uniform()) / static_cast<double>(std::max<size_t>(capacity, 1)));
+  }
+
+  void add(const row_tuple& t) {
+    this->seen++;
+    if (this->rows.size() < this->capacity) {
+      this->rows.push_back(t);
+      if (this->rows.size() == this->capacity) {
+        this->schedule_next();
+      }
+      return;
+    }
+    if (this->seen < this->next_replace || this->capacity == 0) {
+      return;
+    }
+    this->rows[std::uniform_int_distribution<size_t>(0, this->capacity - 1)(this->rng)] = t;
+    this->w *= std::exp(std::log(this->uniform()) / static_cast<double>(this->capacity));
+    this->schedule_next();
+  }
+
+  // Replaces this sample with a uniform sample of both streams. Each
+  // output row is drawn from one side with probability proportional to
+  // the rows that side has seen and not yet given out. Meant for
+  // finished samples: rows added afterwards are only roughly uniform.
+  void merge(const reservoir_sample& other) {
+    vector<row_tuple> a = std::move(this->rows);
+    vector<row_tuple> b = other.rows;
+    std::shuffle(a.begin(), a.end(), this->rng);
+    std::shuffle(b.begin(), b.end(), this->rng);
+    double left_a = static_cast<double>(this->seen);
+    double left_b = static_cast<double>(other.seen);
+    size_t ia = 0;
+    size_t ib = 0;
+    this->rows.clear();
+    while (this->rows.size() < this->capacity && (ia < a.size() || ib < b.size())) {
+      bool take_a = ib == b.size() ||
+          (ia < a.size() && this->uniform() * (left_a + left_b) < left_a);
+      if (take_a) {
+        this->rows.push_back(std::move(a[ia++]));
+        left_a--;
+      } else {
+        this->rows.push_back(std::move(b[ib++]));
+        left_b--;
+      }
+    }
+    this->seen += other.seen;
+    this->next_replace = this->seen;
+    if (this->rows.size() == this->capacity) {
+      this->schedule_next();
+    }
+  }
+
+  size_t capacity;
+  // Rows offered so far.
+  uint64_t seen = 0;
+  vector<row_tuple> rows;
+
+ private:
+  double uniform() {
+    // In (0, 1), so that log() is finite.
+    return std::uniform_real_distribution<double>(std::numeric_limits<double>::min(), 1)(this->rng);
+  }
+
+  void schedule_next() {
+    double skip = std::floor(std::log(this->uniform()) / std::log1p(-this->w));
+    this->next_replace = this->seen + 1 + static_cast<uint64_t>(std::min(skip, 1e18));
+  }
+
+  std::mt19937_64 rng;
+  double w;
+  // The row number (counting from 1) that replaces a sampled row next.
+  uint64_t next_replace = 0;
+};
+
+// Returns a uniform sample of `capacity` rows of its input, in no
+// particular order.
+class reservoir_sample_iterator : public iterator {
+ public:
+  reservoir_sample_iterator (iterator *input, size_t capacity, uint64_t seed = 0) :
+      input(input), capacity(capacity), seed(seed) {}
+
+  void init() {
+    this->input->init();
+    reservoir_sample sample(this->capacity, this->seed);
+    row_tuple t;
+    while (this->input->next(&t)) {
+      sample.add(t);
+    }
+    this->rows = std::move(sample.rows);
+    this->index = 0;
+  }
+
+  bool next(row_tuple *row) {
+    if (this->index >= this->rows.size()) {
+      return false;
+    }
+    std::swap(*row, this->rows[this->index++]);
+    return true;
+  }
+
+  void close() {
+    this->rows.clear();
+    this->input->close();
+  }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    return this->input->push_runtime_filter(filter);
+  }
+
+ private:
+  iterator *input;
+  size_t capacity;
+  uint64_t seed;
+  vector<row_tuple> rows;
+  size_t index = 0;
+};
+
+// Default HyperLogLog precision: 2^14 registers (16 KB), for a relative
+// standard error of 1.04 / sqrt(2^14), about 0.8%.
+const int kHLLPrecision = 14;
+
+// Approximate count of distinct values (HyperLogLog with 64-bit hashes,
+// as in HLL++). Instead of HLL++'s empirical bias tables, estimate()
+// uses Ertl's improved estimator ("New cardinality estimation algorithms
+// for HyperLogLog sketches", 2017), which is unbiased from zero up to
+// well past 2^50 distinct values. Sketches with the same precision
+// merge losslessly, so each thread can keep its own.
+class hyperloglog {
+ public:
+  hyperloglog (int precision = kHLLPrecision) :
+      precision(std::min(std::max(precision, 4), 18)),
+      registers(size_t(1) << this->precision, 0) {}
+
+  // `hash` must be well mixed across all 64 bits.
+  void add_hash(uint64_t hash) {
+    size_t index = hash >> (64 - this->precision);
+    uint64_t rest = hash << this->precision;
+    int q = 64 - this->precision;
+    auto rank = static_cast<uint8_t>(rest == 0 ? q + 1 : __builtin_clzll(rest) + 1);
+    if (rank > this->registers[index]) {
+      this->registers[index] = rank;
+    }
+  }
+
+  void add(const value& v) {
+    this->add_hash(mix_hash(value_hash()(v)));
+  }
+
+  void merge(const hyperloglog& other) {
+    if (other.precision != this->precision) {
+      throw runtime_error("Cannot merge HyperLogLog sketches of different precisions");
+    }
+    for (size_t i = 0; i < this->registers.size(); i++) {
+      this->registers[i] = std::max(this->registers[i], other.registers[i]);
+    }
+  }
+
+  double estimate() const {
+    int q = 64 - this->precision;
+    vector<double> counts(q + 2, 0);
+    for (auto r : this->registers) {
+      counts[r]++;
+    }
+    double m = static_cast<double>(this->registers.size());
+    double z = m * tau(1 - counts[q + 1] / m);
+    for (int k = q; k >= 1; k--) {
+      z = 0.5 * (z + counts[k]);
+    }
+    z += m * sigma(counts[0] / m);
+    return m * m / (2 * std::log(2.0) * z);
+  }
+
+  int precision;
+
+ private:
+  static double sigma(double x) {
+    if (x == 1) {
+      return std::numeric_limits<double>::infinity();
+    }
+    double y = 1;
+    double z = x;
+    while (true) {
+      x *= x;
+      double prev = z;
+      z += x * y;
+      y += y;
+      if (z == prev) {
+        return z;
+      }
+    }
+  }
+
+  static double tau(double x) {
+    if (x == 0 || x == 1) {
+      return 0;
+    }
+    double y = 1;
+    double z = 1 - x;
+    while (true) {
+      x = std::sqrt(x);
+      double prev = z;
+      y *= 0.5;
+      z -= (1 - x) * (1 - x) * y;
+      if (z == prev) {
+        return z / 3;
+      }
+    }
+  }
+
+  vector<uint8_t> registers;
+};
+
+// Counts the distinct non-null values of `cols` (together) with a
+// hyperloglog. Returns one row, like average_iterator.
+class approx_count_distinct_iterator : public iterator {
+ public:
+  approx_count_distinct_iterator (iterator *input, vector<string> cols,
+                                  string aggregated_col_name = "count_distinct",
+                                  int precision = kHLLPrecision) :
+      input(input), cols(cols), aggregated_col_name(aggregated_col_name), precision(precision) {}
+
+  void init() {
+    this->input->init();
+  }
+
+  bool next(row_tuple *row) {
+    if (this->done) {
+      return false;
+    }
+    hyperloglog sketch(this->precision);
+    row_tuple t;
+    while (this->input->next(&t)) {
+      // value_vector_hash of the key, without building the key.
+      size_t h = 0;
+      bool has_null = false;
+      for (const auto& c : this->cols) {
+        static const value null_value;
+        auto it = t.row_data.find(c);
+        const value& v = it == t.row_data.end() ? null_value : it->second;
+        h = h * 31 + value_hash()(v);
+        has_null = has_null || v.is_null();
+      }
+      if (!has_null) {
+        sketch.add_hash(mix_hash(h));
+      }
+    }
+    this->done = true;
+    row->row_data = {{this->aggregated_col_name, static_cast<int64_t>(std::llround(sketch.estimate()))}};
+    return true;
+  }
+
+  void close() {
+    this->done = false;
+    this->input->close();
+  }
+
+ private:
+  iterator *input;
+  vector<string> cols;
+  string aggregated_col_name;
+  int precision;
+  bool done = false;
+};
+
+// Default KLL accuracy parameter: about 0.8% rank error.
+const size_t kKLLAccuracy = 400;
+
+// Approximate quantiles of a stream of numbers (Karnin, Lang and
+// Liberty's KLL sketch) in O(k) space. With accuracy parameter k, the
+// rank of a returned quantile is within about 1.65% * 200 / k of the one
+// asked for, with 99% confidence (the figures measured for
+// DataSketches' KLL). Sketches with the same k merge, so each thread
+// can keep its own.
+class kll_sketch {
+ public:
+  kll_sketch (size_t k = kKLLAccuracy, uint64_t seed = 0) :
+      k(std::max<size_t>(k, 8)), rng(seed) {
+    this->add_level();
+  }
+
+  void add(double v) {
+    this->levels[0].push_back(v);
+    this->n++;
+    // Only a full bottom level starts a compaction.
+    if (this->levels[0].size() >= this->capacities[0]) {
+      this->compress();
+    }
+  }
+
+  void merge(const kll_sketch& other) {
+    if (other.k != this->k) {
+      throw runtime_error("Cannot merge KLL sketches with different accuracy parameters");
+    }
+    while (this->levels.size() < other.levels.size()) {
+      this->add_level();
+    }
+    for (size_t h = 0; h < other.levels.size(); h++) {
+      this->levels[h].insert(this->levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+    }
+    this->n += other.n;
+    this->compress();
+  }
+
+  // The value at rank `q` (0 is the minimum, 1 the maximum). NaN if
+  // nothing was added.
+  double quantile(double q) const {
+    vector<std::pair<double, uint64_t> > weighted;
+    for (size_t h = 0; h < this->levels.size(); h++) {
+      for (double v : this->levels[h]) {
+        weighted.emplace_back(v, uint64_t(1) << h);
+      }
+    }
+    if (weighted.empty()) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    std::sort(weighted.begin(), weighted.end());
+    uint64_t total = 0;
+    for (const auto& p : weighted) {
+      total += p.second;
+    }
+    double target = std::min(std::max(q, 0.0), 1.0) * static_cast<double>(total);
+    uint64_t cumulative = 0;
+    for (const auto& p : weighted) {
+      cumulative += p.second;
+      if (static_cast<double>(cumulative) >= target) {
+        return p.first;
+      }
+    }
+    return weighted.back().first;
+  }
+
+  // Values added, over all merged sketches.
+  uint64_t count() const { return this->n; }
+
+ private:
+  // Adds a level on top. Level h may hold k * (2/3)^(depth - h) items,
+  // and at least two, so the levels below shrink.
+  void add_level() {
+    this->levels.emplace_back();
+    size_t depth = this->levels.size() - 1;
+    this->capacities.resize(this->levels.size());
+    double capacity = static_cast<double>(this->k);
+    for (size_t h = depth + 1; h-- > 0;) {
+      this->capacities[h] = std::max<size_t>(2, static_cast<size_t>(std::ceil(capacity)));
+      capacity *= 2.0 / 3;
+    }
+  }
+
+  // While a level is over capacity, sorts it and promotes every other
+  // item (starting at a random one) to the level above, each then
+  // standing for twice as many values.
+  void compress() {
+    for (size_t h = 0; h < this->levels.size(); h++) {
+      if (this->levels[h].size() < this->capacities[h]) {
+        continue;
+      }
+      if (h + 1 == this->levels.size()) {
+        this->add_level();
+      }
+      auto& level = this->levels[h];
+      std::sort(level.begin(), level.end());
+      // An odd item out stays behind.
+      double leftover = 0;
+      bool has_leftover = level.size() % 2 == 1;
+      if (has_leftover) {
+        leftover = level.back();
+        level.pop_back();
+      }
+      size_t offset = std::uniform_int_distribution<size_t>(0, 1)(this->rng);
+      for (size_t i = offset; i < level.size(); i += 2) {
+        this->levels[h + 1].push_back(level[i]);
+      }
+      level.clear();
+      if (has_leftover) {
+        level.push_back(leftover);
+      }
+    }
+  }
+
+  size_t k;
+  std::mt19937_64 rng;
+  vector<vector<double> > levels;
+  // Item capacity of each level.
+  vector<size_t> capacities;
+  uint64_t n = 0;
+};
+
+// Returns one row with the approximate `quantile` (0.5 for the median)
+// of the non-null numbers in `col`, from a kll_sketch.
+class approx_quantile_iterator : public iterator {
+ public:
+  approx_quantile_iterator (iterator *input, string col, double quantile,
+                            string aggregated_col_name = "quantile", size_t k = kKLLAccuracy) :
+      input(input), col(col), quantile(quantile), aggregated_col_name(aggregated_col_name), k(k) {}
+
+  void init() {
+    this->input->init();
+  }
+
+  bool next(row_tuple *row) {
+    if (this->done) {
+      return false;
+    }
+    kll_sketch sketch(this->k);
+    row_tuple t;
+    while (this->input->next(&t)) {
+      auto it = t.row_data.find(this->col);
+      if (it != t.row_data.end() && !it->second.is_null()) {
+        sketch.add(it->second.as_double());
+      }
+    }
+    this->done = true;
+    value result;
+    if (sketch.count() > 0) {
+      result = value(sketch.quantile(this->quantile));
+    }
+    row->row_data = {{this->aggregated_col_name, result}};
+    return true;
+  }
+
+  void close() {
+    this->done = false;
+    this->input->close();
+  }
+
+ private:
+  iterator *input;
+  string col;
+  double quantile;
+  string aggregated_col_name;
+  size_t k;
+  bool done = false;
+};
+
+// Pipelines fused at compile time. Where a chain of iterators pays a
+// virtual next() and hash lookups into a row_tuple at every level, here each
+// stage is a template over the next one, and rows are pushed down to
+// the sink by reference, so a scan -> filter -> project -> aggregate
+// chain compiles to one loop over the source with the stages inlined:
+//
+//   double avg = fused_batches(&scan)
+//       .filter("movieid", [](const value& v) { return v == 1222; })
+//       .average("rating");
+//
+// Use iterators for plans built at runtime, and these for fixed ones.
+
+// A row of a row_batch, read in place.
+class batch_row {
+ public:
+  const row_batch *batch;
+  uint32_t row;
+};
+
+// Only the columns `cols` of a row, as seen downstream of a project().
+template <typename Row>
+class projected_row {
+ public:
+  const Row& row;
+  const vector<string> *cols;
+};
+
+// A column read by a fused stage. Its position in row_batches, and
+// whether a project() kept it, are looked up once per scan rather than
+// per row. A value read from a batch_row stays valid until the next get().
+class fused_column {
+ public:
+  fused_column (string name) :
+      name(std::move(name)) {}
+
+  const value& get(const row_tuple& t) {
+    static const value null_value;
+    auto it = t.row_data.find(this->name);
+    return it == t.row_data.end() ? null_value : it->second;
+  }
+
+  const value& get(const batch_row& r) {
+    if (r.batch->columns != this->columns) {
+      this->columns = r.batch->columns;
+      this->index = r.batch->column_index(this->name);
+    }
+    r.batch->get(r.row, this->index, &this->cell);
+    return this->cell;
+  }
+
+  // Null if the column was projected away, as for projection_iterator.
+  template <typename Row>
+  const value& get(const projected_row<Row>& r) {
+    static const value null_value;
+    if (r.cols != this->projection) {
+      this->projection = r.cols;
+      this->projected = std::find(r.cols->begin(), r.cols->end(), this->name) != r.cols->end();
+    }
+    return this->projected ? this->get(r.row) : null_value;
+  }
+
+  string name;
+
+ private:
+  const vector<string> *columns = nullptr;
+  size_t index = 0;
+  value cell;
+  const vector<string> *projection = nullptr;
+  bool projected = false;
+};
+
+row_tuple materialize_row(const row_tuple& t) { return t; }
+
+row_tuple materialize_row(const batch_row& r) {
+  row_tuple t;
+  r.batch->materialize(r.row, r.batch->visible, &t);
+  return t;
+}
+
+template <typename Row>
+row_tuple materialize_row(const projected_row<Row>& r) {
+  unordered_map<string, value> row_tuple_data;
+  for (const auto& c : *r.cols) {
+    row_tuple_data[c] = fused_column(c).get(r.row);
+  }
+  return row_tuple(row_tuple_data);
+}
+
+template <typename Pred, typename Next>
+class fused_filter_stage {
+ public:
+  fused_filter_stage (string col, Pred pred, Next next) :
+      col(std::move(col)), pred(std::move(pred)), next(std::move(next)) {}
+
+  template <typename Row>
+  void push(const Row& row) {
+    if (this->pred(this->col.get(row))) {
+      this->next.push(row);
+    }
+  }
+
+  auto finish() { return this->next.finish(); }
+
+ private:
+  fused_column col;
+  Pred pred;
+  Next next;
+};
+
+template <typename Next>
+class fused_project_stage {
+ public:
+  fused_project_stage (vector<string> cols, Next next) :
+      cols(std::move(cols)), next(std::move(next)) {}
+
+  template <typename Row>
+  void push(const Row& row) {
+    this->next.push(projected_row<Row>{row, &this->cols});
+  }
+
+  auto finish() { return this->next.finish(); }
+
+ private:
+  vector<string> cols;
+  Next next;
+};
+
+class fused_average_sink {
+ public:
+  fused_average_sink (string col) :
+      col(std::move(col)) {}
+
+  template <typename Row>
+  void push(const Row& row) {
+    const auto& v = this->col.get(row);
+    if (!v.is_null()) {
+      this->sum += v.as_double();
+      this->count++;
+    }
+  }
+
+  // NaN for no rows, like average_iterator.
+  double finish() { return this->sum / static_cast<double>(this->count); }
+
+ private:
+  fused_column col;
+  double sum = 0;
+  int64_t count = 0;
+};
+
+class fused_count_sink {
+ public:
+  template <typename Row>
+  void push(const Row& row) {
+    this->count++;
+  }
+
+  int64_t finish() { return this->count; }
+
+ private:
+  int64_t count = 0;
+};
+
+class fused_collect_sink {
+ public:
+  template <typename Row>
+  void push(const Row& row) {
+    this->rows.push_back(materialize_row(row));
+  }
+
+  vector<row_tuple> finish() { return std::move(this->rows); }
+
+ private:
+  vector<row_tuple> rows;
+};
+
+template <typename F>
+class fused_for_each_sink {
+ public:
+  fused_for_each_sink (F f) :
+      f(std::move(f)) {}
+
+  // The row is only valid during the call; materialize_row() copies it.
+  template <typename Row>
+  void push(const Row& row) {
+    this->f(row);
+  }
+
+  int finish() { return 0; }
+
+ private:
+  F f;
+};
+
+// Pushes the rows of an iterator.
+class fused_iterator_source {
+ public:
+  iterator *input;
+
+  template <typename Consumer>
+  void run(Consumer& consumer) {
+    this->input->init();
+    row_tuple t;
+    while (this->input->next(&t)) {
+      consumer.push(t);
+    }
+    this->input->close();
+  }
+};
+
+// Pushes rows held in memory, without copying them.
+class fused_vector_source {
+ public:
+  const vector<row_tuple> *rows;
+
+  template <typename Consumer>
+  void run(Consumer& consumer) {
+    for (const auto& t : *this->rows) {
+      consumer.push(t);
+    }
+  }
+};
+
+// Pushes the selected rows of each batch, unparsed until a stage reads
+// them.
+class fused_batch_source {
+ public:
+  batch_iterator *input;
+
+  template <typename Consumer>
+  void run(Consumer& consumer) {
+    this->input->init();
+    row_batch batch;
+    while (this->input->next_batch(&batch)) {
+      for (auto row : batch.selection) {
+        consumer.push(batch_row{&batch, row});
+      }
+    }
+    this->input->close();
+  }
+};
+
+// A source and the stages after it, so far. `Wrap` turns a sink into
+// the stages' consumer chain ending in it.
+template <typename Source, typename Wrap>
+class fused_pipeline {
+ public:
+  fused_pipeline (Source source, Wrap wrap) :
+      source(source), wrap(std::move(wrap)) {}
+
+  // Keeps rows for which `pred(value of col)` is true.
+  template <typename Pred>
+  auto filter(string col, Pred pred) const {
+    auto wrap = this->wrap;
+    return this->then([wrap, col, pred](auto next) {
+        return wrap(fused_filter_stage<Pred, decltype(next)>(col, pred, std::move(next)));
+      });
+  }
+
+  auto project(vector<string> cols) const {
+    auto wrap = this->wrap;
+    return this->then([wrap, cols](auto next) {
+        return wrap(fused_project_stage<decltype(next)>(cols, std::move(next)));
+      });
+  }
+
+  // Runs the pipeline. Each returns its sink's result.
+  double average(string col) { return this->run(fused_average_sink(std::move(col))); }
+  int64_t count() { return this->run(fused_count_sink()); }
+  vector<row_tuple> collect() { return this->run(fused_collect_sink()); }
+
+  template <typename F>
+  void for_each(F f) { this->run(fused_for_each_sink<F>(std::move(f))); }
+
+ private:
+  template <typename NewWrap>
+  fused_pipeline<Source, NewWrap> then(NewWrap wrap) const {
+    return fused_pipeline<Source, NewWrap>(this->source, std::move(wrap));
+  }
+
+  template <typename Sink>
+  auto run(Sink sink) {
+    auto chain = this->wrap(std::move(sink));
+    this->source.run(chain);
+    return chain.finish();
+  }
+
+  Source source;
+  Wrap wrap;
+};
+
+// Starts a fused pipeline over the rows of `input`.
+inline auto fused_rows(iterator *input) {
+  auto identity = [](auto sink) { return sink; };
+  return fused_pipeline<fused_iterator_source, decltype(identity)>({input}, identity);
+}
+
+// Starts a fused pipeline over `rows`, which must outlive it.
+inline auto fused_rows(const vector<row_tuple>& rows) {
+  auto identity = [](auto sink) { return sink; };
+  return fused_pipeline<fused_vector_source, decltype(identity)>({&rows}, identity);
+}
+
+// Starts a fused pipeline over the batches of `input` (such as a
+// csv_scan_iterator), parsing only the cells the stages read.
+inline auto fused_batches(batch_iterator *input) {
+  auto identity = [](auto sink) { return sink; };
+  return fused_pipeline<fused_batch_source, decltype(identity)>({input}, identity);
+}
+
+// Sorts spread over threads only for inputs at least this big; below it
+// starting the threads costs more than they save.
+const size_t kParallelSortMinRows = 1 << 16;
+// Sample sort cuts its input into this many buckets per thread, so a
+// thread that finishes early picks up another bucket.
+const size_t kSortBucketsPerThread = 4;
+// Entries sampled per bucket to choose the splitters.
+const size_t kSortSamplesPerBucket = 32;
+
+// One column of a sort order.
+struct sort_key {
+  string col;
+  bool descending = false;
+};
+
+inline void append_big_endian(uint64_t bits, string *out) {
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    out->push_back(static_cast<char>(bits >> shift));
+  }
+}
+
+// Appends `v` to `out` so that memcmp over two keys built from the same
+// sort order agrees with compare_values column by column. Every value
+// starts with its type rank; numbers are their double (with the sign bit
+// flipped, and all bits flipped for negatives) followed by their int64
+// to tell apart integers the double rounds together; strings escape
+// 0x00 as 0x00 0xff and end with 0x00 0x00, so no key is a prefix of
+// another. Descending columns invert their bytes.
+void encode_sort_key(const value& v, bool descending, string *out) {
+  const uint64_t kSignBit = uint64_t(1) << 63;
+  size_t start = out->size();
+  auto rank = v.type == value_type::float64 ? value_type::int64 : v.type;
+  out->push_back(static_cast<char>(rank));
+  switch (v.type) {
+    case value_type::null:
+      break;
+    case value_type::int64:
+    case value_type::float64: {
+      double d = v.as_double();
+      uint64_t bits;
+      if (std::isnan(d)) {
+        bits = ~uint64_t(0);
+      } else {
+        // Make -0.0 equal to 0.0.
+        d = d == 0 ? 0.0 : d;
+        std::memcpy(&bits, &d, sizeof(bits));
+        bits = (bits & kSignBit) ? ~bits : bits | kSignBit;
+      }
+      append_big_endian(bits, out);
+      int64_t i = v.i;
+      if (v.type == value_type::float64) {
+        // A float equal to an integer gets the same key as the integer.
+        bool in_range = d >= -9223372036854775808.0 && d < 9223372036854775808.0;
+        i = in_range ? static_cast<int64_t>(d) : 0;
+      }
+      append_big_endian(static_cast<uint64_t>(i) ^ kSignBit, out);
+      break;
+    }
+    case value_type::string:
+      for (char c : v.s) {
+        out->push_back(c);
+        if (c == '\0') {
+          out->push_back('\xff');
+        }
+      }
+      out->push_back('\0');
+      out->push_back('\0');
+      break;
+    default:
+      append_big_endian(static_cast<uint64_t>(v.i) ^ kSignBit, out);
+      break;
+  }
+  if (descending) {
+    for (size_t i = start; i < out->size(); i++) {
+      (*out)[i] = static_cast<char>(~(*out)[i]);
+    }
+  }
+}
+
+// A row's encoded sort key. The first 8 bytes are also kept in `prefix`
+// so that most comparisons never touch the key bytes.
+struct sort_entry {
+  uint64_t prefix;
+  const unsigned char *key;
+  uint32_t length;
+  uint32_t row;
+};
+
+// Orders entries by key, and equal keys by row, which makes the sort
+// stable and every entry distinct.
+inline bool sort_entry_less(const sort_entry& a, const sort_entry& b) {
+  if (a.prefix != b.prefix) {
+    return a.prefix < b.prefix;
+  }
+  uint32_t n = std::min(a.length, b.length);
+  if (n > sizeof(uint64_t)) {
+    int c = std::memcmp(a.key + sizeof(uint64_t), b.key + sizeof(uint64_t), n - sizeof(uint64_t));
+    if (c != 0) {
+      return c < 0;
+    }
+  }
+  if (a.length != b.length) {
+    return a.length < b.length;
+  }
+  return a.row < b.row;
+}
+
+// Runs `fn(0)` ... `fn(threads - 1)` at once, the first on the calling
+// thread, and rethrows the first exception any of them threw.
+template <typename F>
+void run_on_threads(size_t threads, F fn) {
+  vector<std::exception_ptr> errors(threads);
+  auto guarded = [&fn, &errors](size_t t) {
+    try {
+      fn(t);
+    } catch (...) {
+      errors[t] = std::current_exception();
+    }
+  };
+  vector<std::thread> workers;
+  for (size_t t = 1; t < threads; t++) {
+    workers.emplace_back(guarded, t);
+  }
+  guarded(0);
+  for (auto& w : workers) {
+    w.join();
+  }
+  for (auto& e : errors) {
+    if (e) {
+      std::rethrow_exception(e);
+    }
+  }
+}
+
+// Sorts `entries` with a sample sort on `threads` threads: splitters
+// drawn from a sample cut the entries into buckets, each thread scatters
+// its share of the entries into the buckets, and the buckets are then
+// sorted independently.
+void parallel_sort_entries(vector<sort_entry> *entries, size_t threads) {
+  auto& in = *entries;
+  size_t n = in.size();
+  if (threads <= 1 || n < kParallelSortMinRows) {
+    std::sort(in.begin(), in.end(), sort_entry_less);
+    return;
+  }
+
+  // Entries are distinct, so even a key shared by most rows is spread
+  // over several buckets.
+  size_t buckets = threads * kSortBucketsPerThread;
+  vector<sort_entry> sample;
+  std::mt19937_64 rng(n);
+  for (size_t i = 0; i < buckets * kSortSamplesPerBucket; i++) {
+    sample.push_back(in[rng() % n]);
+  }
+  std::sort(sample.begin(), sample.end(), sort_entry_less);
+  vector<sort_entry> splitters;
+  for (size_t b = 1; b < buckets; b++) {
+    splitters.push_back(sample[b * kSortSamplesPerBucket]);
+  }
+
+  auto begin_of = [n, threads](size_t t) { return n * t / threads; };
+  vector<uint32_t> bucket_of(n);
+  vector<size_t> counts(threads * buckets);
+  run_on_threads(threads, [&](size_t t) {
+    size_t *count = &counts[t * buckets];
+    for (size_t i = begin_of(t); i < begin_of(t + 1); i++) {
+      auto b = std::upper_bound(splitters.begin(), splitters.end(), in[i], sort_entry_less) - splitters.begin();
+      bucket_of[i] = static_cast<uint32_t>(b);
+      count[b]++;
+    }
+  });
+
+  // Turn the counts into where each thread writes into each bucket.
+  vector<size_t> bucket_begin(buckets + 1);
+  size_t offset = 0;
+  for (size_t b = 0; b < buckets; b++) {
+    bucket_begin[b] = offset;
+    for (size_t t = 0; t < threads; t++) {
+      size_t count = counts[t * buckets + b];
+      counts[t * buckets + b] = offset;
+      offset += count;
+    }
+  }
+  bucket_begin[buckets] = n;
+
+  vector<sort_entry> out(n);
+  run_on_threads(threads, [&](size_t t) {
+    size_t *next = &counts[t * buckets];
+    for (size_t i = begin_of(t); i < begin_of(t + 1); i++) {
+      out[next[bucket_of[i]]++] = in[i];
+    }
+  });
+
+  std::atomic<size_t> next_bucket(0);
+  run_on_threads(threads, [&](size_t) {
+    for (size_t b = next_bucket++; b < buckets; b = next_bucket++) {
+      std::sort(out.begin() + bucket_begin[b], out.begin() + bucket_begin[b + 1], sort_entry_less);
+    }
+  });
+  in.swap(out);
+}
+
+// Sorts its input in memory. Each row's sort key is encoded once into
+// bytes that compare with memcmp, and the keys, not the rows, are sorted
+// on all cores; the rows are then returned in key order. Equal keys keep
+// their input order.
+class sort_iterator : public iterator {
+ public:
+  // Pass `col_to_sort: ""` to sort on all columns, in name order.
+  sort_iterator (iterator *input, string col_to_sort) :
+      sort_iterator(input, col_to_sort == "" ? vector<sort_key>() : vector<sort_key>{{col_to_sort}}) {}
+
+  // Sorts on `keys` in turn; no keys sorts on all columns, in name order.
+  // `threads: 0` uses one thread per core.
+  sort_iterator (iterator *input, vector<sort_key> keys, size_t threads = 0) :
+      input(input), keys(keys),
+      threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency())) {}
+
+  void init() {
+    this->input->init();
+
+    // Read all data into memory.
+    auto& rows = this->rows;
+    row_tuple t;
+    while (this->input->next(&t)) {
+      this->memory.grow(estimate_row_bytes(t));
+      rows.push_back(std::move(t));
+    }
+    if (rows.size() > std::numeric_limits<uint32_t>::max()) {
+      throw runtime_error("Too many rows to sort in memory");
+    }
+
+    auto keys = this->keys;
+    if (keys.empty() && !rows.empty()) {
+      for (const auto& p : rows[0].row_data) {
+        keys.push_back({p.first});
+      }
+      std::sort(keys.begin(), keys.end(), [](const sort_key& a, const sort_key& b) { return a.col < b.col; });
+    }
+
+    // Each thread encodes the keys of a range of rows into its own buffer.
+    size_t n = rows.size();
+    size_t threads = n < kParallelSortMinRows ? 1 : this->threads;
+    vector<sort_entry> entries(n);
+    vector<string> key_bytes(threads);
+    run_on_threads(threads, [&](size_t t) {
+      size_t begin = n * t / threads;
+      size_t end = n * (t + 1) / threads;
+      auto& buf = key_bytes[t];
+      const value null_value;
+      for (size_t i = begin; i < end; i++) {
+        size_t start = buf.size();
+        for (const auto& k : keys) {
+          auto cell = rows[i].row_data.find(k.col);
+          encode_sort_key(cell == rows[i].row_data.end() ? null_value : cell->second, k.descending, &buf);
+        }
+        entries[i].length = static_cast<uint32_t>(buf.size() - start);
+        entries[i].row = static_cast<uint32_t>(i);
+      }
+      // The buffer no longer moves, so point the entries into it.
+      auto key = reinterpret_cast<const unsigned char *>(buf.data());
+      for (size_t i = begin; i < end; i++) {
+        auto& e = entries[i];
+        e.key = key;
+        e.prefix = 0;
+        for (size_t b = 0; b < sizeof(uint64_t); b++) {
+          e.prefix = (e.prefix << 8) | (b < e.length ? key[b] : 0);
+        }
+        key += e.length;
+      }
+    });
+    // Reserve the peak, while the keys and the rows are both held.
+    int64_t key_total = 0;
+    for (const auto& buf : key_bytes) {
+      key_total += buf.size();
+    }
+    this->memory.grow(key_total + n * (sizeof(sort_entry) + sizeof(uint32_t)));
+
+    parallel_sort_entries(&entries, threads);
+
+    this->order.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      this->order[i] = entries[i].row;
+    }
+  }
+
+  bool next(row_tuple *row) {
+    if (this->index >= this->order.size()) {
+      return false;
+    }
+
+    // Each row is only returned once, so hand it over.
+    std::swap(*row, this->rows[this->order[this->index]]);
+    this->index++;
+    return true;
+  }
+
+  void close() {
+    vector<row_tuple>().swap(this->rows);
+    vector<uint32_t>().swap(this->order);
+    this->memory.release();
+    this->index = 0;
+    this->input->close();
+  }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    return this->input->push_runtime_filter(filter);
+  }
+
+  void track_memory(memory_tracker *tracker) {
+    this->memory.set_tracker(tracker);
+  }
+ private:
+  iterator *input;
+  vector<sort_key> keys;
+  size_t threads;
+  vector<row_tuple> rows;
+  // Indexes into `rows`, in sorted order.
+  vector<uint32_t> order;
+  size_t index = 0;
+  memory_reservation memory;
+};
+
+class distinct_iterator : public iterator {
+ public:
+  distinct_iterator (iterator *input) :
+      input(input) {}
+
+  void init() {
+    this->input->init();
+  }
+
+  bool next(row_tuple *row) {
+    if (this->done) {
+      return false;
+    }
+
+    while (this->input->next(row)) {
+      if (first || (this->current_row != *row)) {
+        assign_row(*row, &this->current_row);
+        first = false;
+        return true;
+      }
+    }
+    this->done = true;
+    return false;
+  }
+
+  void close() {
+    this->done = false;
+    this->first = true;
+    this->current_row = row_tuple();
+    this->input->close();
+  }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    return this->input->push_runtime_filter(filter);
+  }
+
+ private:
+  iterator *input;
+  row_tuple current_row;
+  bool first = true;
+  bool done = false;
+};
+
+// Like distinct_iterator, but does not need sorted input. Keeps every
+// distinct row in memory.
+class hash_distinct_iterator : public iterator {
+ public:
+  hash_distinct_iterator (iterator *input) :
+      input(input) {}
+
+  void init() {
+    this->input->init();
+  }
+
+  bool next(row_tuple *row) {
+    while (this->input->next(row)) {
+      if (this->seen.count(*row) == 0) {
+        this->memory.grow(estimate_row_bytes(*row));
+        this->seen.insert(*row);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void close() {
+    this->seen.clear();
+    this->memory.release();
+    this->input->close();
+  }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    return this->input->push_runtime_filter(filter);
+  }
+
+  void track_memory(memory_tracker *tracker) {
+    this->memory.set_tracker(tracker);
+  }
+
+ private:
+  iterator *input;
+  std::unordered_set<row_tuple, row_tuple_hash> seen;
+  memory_reservation memory;
+};
+
+class nested_loop_join_iterator : public iterator {
+ public:
+  nested_loop_join_iterator (
+      iterator *input0,
+      iterator *input1,
+      vector<std::pair<string, string> > join_on_col0_to_col1
+                             ) :
+      input0(input0), input1(input1), join_on_col0_to_col1(join_on_col0_to_col1) {}
+
+  void init() {
+    this->input0->init();
+    this->input1->init();
+    this->done = !this->input1->next(&this->r1);
+  }
+
+  bool next(row_tuple *row) {
     if (this->done) {
-      return EOF_tuple;
+      return false;
+    }
+
+    while (true) {
+      auto& r0 = this->r0;
+      if (!this->input0->next(&r0)) {
+        this->input0->close();
+
+        if (!this->input1->next(&this->r1)) {
+          // Both inputs are exhausted, we're done.
+          this->done = true;
+          return false;
+        }
+        // Restart input0
+        this->input0->init();
+        if (!this->input0->next(&r0)) {
+          // input0 is an empty table
+          this->done = true;
+          return false;
+        }
+      }
+
+      bool is_match = true;
+      for (const auto& p : this->join_on_col0_to_col1) {
+        if (r0.row_data[p.first] != r1.row_data[p.second]) {
+          is_match = false;
+          break;
+        }
+      }
+      if (is_match) {
+        join_tuples(r0, r1, row);
+        return true;
+      }
+    }
+  }
+
+  void close() {
+    // input0 is already closed at this point.
+    this->input1->close();
+    this->r0 = row_tuple();
+    this->r1 = row_tuple();
+    this->done = false;
+  }
+
+ private:
+  iterator *input0;
+  iterator *input1;
+  row_tuple r0;
+  row_tuple r1;
+  vector<std::pair<string, string> > join_on_col0_to_col1;
+  int done = false;
+};
+
+enum class join_type {
+  inner,
+  // Rows from input0 without a match are returned as-is (without any
+  // of input1's columns).
+  left_outer,
+  // Each row from input0 with at least one match is returned once,
+  // without any of input1's columns.
+  semi,
+};
+
+// Upper bound on the number of input1 rows sharing a single join key
+// that merge_join_iterator will buffer.
+const size_t kMaxMergeJoinRunSize = 1000000;
+
+// Both inputs must already be sorted (ascending, in compare_values
+// order, e.g. by sort_iterator) on their join columns. The inputs are advanced
+// in lockstep, so only one run of input1 rows with equal keys is held
+// in memory at a time.
+class merge_join_iterator : public iterator {
+ public:
+  merge_join_iterator (
+      iterator *input0,
+      iterator *input1,
+      vector<std::pair<string, string> > join_on_col0_to_col1,
+      join_type type = join_type::inner,
+      size_t max_run_size = kMaxMergeJoinRunSize
+                       ) :
+      input0(input0), input1(input1), join_on_col0_to_col1(join_on_col0_to_col1),
+      type(type), max_run_size(max_run_size) {}
+
+  void init() {
+    this->input0->init();
+    this->input1->init();
+    this->has_r1 = this->input1->next(&this->r1);
+  }
+
+  bool next(row_tuple *row) {
+    while (true) {
+      // Keep emitting matches for the current input0 row.
+      if (this->run_index < this->run.size()) {
+        join_tuples(this->r0, this->run[this->run_index], row);
+        this->run_index++;
+        return true;
+      }
+
+      if (!this->input0->next(&this->r0)) {
+        return false;
+      }
+      auto& key0 = this->key0;
+      this->key_of(this->r0, true, &key0);
+
+      if (!this->has_run || key0 != this->run_key) {
+        // Skip input1 rows that are smaller than the input0 key.
+        while (this->has_r1 && this->compare_key1(key0) < 0) {
+          this->has_r1 = this->input1->next(&this->r1);
+        }
+        this->fill_run(key0);
+      }
+
+      if (this->run.empty()) {
+        if (this->type == join_type::left_outer) {
+          assign_row(this->r0, row);
+          return true;
+        }
+        continue;
+      }
+      if (this->type == join_type::semi) {
+        assign_row(this->r0, row);
+        return true;
+      }
+      this->run_index = 0;
+    }
+  }
+
+  void close() {
+    this->input0->close();
+    this->input1->close();
+    this->r0 = row_tuple();
+    this->r1 = row_tuple();
+    this->has_r1 = false;
+    this->run.clear();
+    this->memory.release();
+    this->run_key.clear();
+    this->has_run = false;
+    this->run_index = 0;
+  }
+
+  void track_memory(memory_tracker *tracker) {
+    this->memory.set_tracker(tracker);
+  }
+
+ private:
+  // Sets `key` to the join columns of `t`, reusing its values.
+  void key_of(row_tuple& t, bool is_input0, vector<value> *key) {
+    key->resize(this->join_on_col0_to_col1.size());
+    for (size_t i = 0; i < key->size(); i++) {
+      const auto& p = this->join_on_col0_to_col1[i];
+      (*key)[i] = t.row_data[is_input0 ? p.first : p.second];
+    }
+  }
+
+  // Compares the key of r1 with `key`, as vector<value> would.
+  int compare_key1(const vector<value>& key) {
+    for (size_t i = 0; i < key.size(); i++) {
+      const auto& v = this->r1.row_data[this->join_on_col0_to_col1[i].second];
+      if (v < key[i]) {
+        return -1;
+      }
+      if (key[i] < v) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  // Buffers every input1 row with key `key` (starting at r1), leaving r1
+  // on the first row past the run. The run is left empty when r1 does
+  // not match.
+  void fill_run(const vector<value>& key) {
+    this->run.clear();
+    this->memory.release();
+    this->run_key = key;
+    this->has_run = true;
+    while (this->has_r1 && this->compare_key1(key) == 0) {
+      if (this->run.size() >= this->max_run_size) {
+        throw runtime_error("merge join: too many rows with the same join key");
+      }
+      this->memory.grow(estimate_row_bytes(this->r1));
+      this->run.push_back(this->r1);
+      this->has_r1 = this->input1->next(&this->r1);
+    }
+    // Prevent the run from being returned again before the next input0 row.
+    this->run_index = this->run.size();
+  }
+
+  iterator *input0;
+  iterator *input1;
+  vector<std::pair<string, string> > join_on_col0_to_col1;
+  join_type type;
+  size_t max_run_size;
+
+  row_tuple r0;
+  row_tuple r1;
+  bool has_r1 = false;
+  vector<value> key0;
+  vector<row_tuple> run;
+  vector<value> run_key;
+  bool has_run = false;
+  size_t run_index = 0;
+  memory_reservation memory;
+};
+
+// Builds a hash table over input1 at init() and streams input0 through
+// it, so input0 is read once and its order is preserved. For inner and
+// semi joins, a Bloom filter of input1's keys is pushed into input0 so
+// that its scan can drop rows that cannot match before parsing them.
+class hash_join_iterator : public iterator {
+ public:
+  hash_join_iterator (
+      iterator *input0,
+      iterator *input1,
+      vector<std::pair<string, string> > join_on_col0_to_col1,
+      join_type type = join_type::inner
+                      ) :
+      input0(input0), input1(input1), join_on_col0_to_col1(join_on_col0_to_col1),
+      type(type) {}
+
+  void init() {
+    this->input1->init();
+    row_tuple t;
+    while (this->input1->next(&t)) {
+      this->key_of(t, false, &this->key);
+      this->memory.grow(estimate_row_bytes(t));
+      this->table[this->key].push_back(std::move(t));
+    }
+
+    if (this->type != join_type::left_outer) {
+      auto filter = std::make_shared<bloom_filter>(this->table.size());
+      for (const auto& p : this->table) {
+        filter->insert(value_vector_hash()(p.first));
+      }
+      runtime_filter rf;
+      for (const auto& p : this->join_on_col0_to_col1) {
+        rf.cols.push_back(p.first);
+      }
+      rf.filter = filter;
+      this->input0->push_runtime_filter(rf);
+    }
+    this->input0->init();
+  }
+
+  bool next(row_tuple *row) {
+    while (true) {
+      if (this->matches != nullptr && this->match_index < this->matches->size()) {
+        join_tuples(this->r0, (*this->matches)[this->match_index], row);
+        this->match_index++;
+        return true;
+      }
+
+      if (!this->input0->next(&this->r0)) {
+        this->matches = nullptr;
+        return false;
+      }
+      this->key_of(this->r0, true, &this->key);
+      auto it = this->table.find(this->key);
+      this->matches = nullptr;
+      if (it == this->table.end()) {
+        if (this->type == join_type::left_outer) {
+          assign_row(this->r0, row);
+          return true;
+        }
+        continue;
+      }
+      if (this->type == join_type::semi) {
+        assign_row(this->r0, row);
+        return true;
+      }
+      this->matches = &it->second;
+      this->match_index = 0;
+    }
+  }
+
+  void close() {
+    this->input0->close();
+    this->input1->close();
+    this->table.clear();
+    this->memory.release();
+    this->matches = nullptr;
+    this->r0 = row_tuple();
+  }
+
+  void track_memory(memory_tracker *tracker) {
+    this->memory.set_tracker(tracker);
+  }
+
+ private:
+  // Sets `key` to the join columns of `t`, reusing its values.
+  void key_of(row_tuple& t, bool is_input0, vector<value> *key) {
+    key->resize(this->join_on_col0_to_col1.size());
+    for (size_t i = 0; i < key->size(); i++) {
+      const auto& p = this->join_on_col0_to_col1[i];
+      (*key)[i] = t.row_data[is_input0 ? p.first : p.second];
+    }
+  }
+
+  iterator *input0;
+  iterator *input1;
+  vector<std::pair<string, string> > join_on_col0_to_col1;
+  join_type type;
+  vector<value> key;
+
+  unordered_map<vector<value>, vector<row_tuple>, value_vector_hash> table;
+  row_tuple r0;
+  const vector<row_tuple> *matches = nullptr;
+  size_t match_index = 0;
+  memory_reservation memory;
+};
+
+// Logical plans describe what a query computes; query_planner turns them
+// into a tree of iterators.
+enum class logical_op {
+  csv_scan,
+  dataset_scan,
+  manual_scan,
+  filter,
+  project,
+  join,
+  sort,
+  distinct,
+  average,
+};
+
+class logical_node;
+using logical_plan = std::shared_ptr<logical_node>;
+
+class logical_node {
+ public:
+  logical_op op;
+  vector<logical_plan> inputs;
+
+  // csv_scan, dataset_scan, manual_scan: the columns produced. project:
+  // the columns kept.
+  vector<string> cols;
+  // csv_scan, dataset_scan
+  string path;
+  vector<value_type> column_types;
+  // dataset_scan: filters that only read partition columns.
+  vector<partition_filter> partition_filters;
+  // manual_scan
+  vector<row_tuple> rows;
+  // filter. `predicate_cols` must list every column the predicate reads.
+  bool (*predicate)(const row_tuple&) = nullptr;
+  vector<string> predicate_cols;
+  // join (inner equi-join)
+  vector<std::pair<string, string> > join_on;
+  // sort, average
+  string col;
+  // average
+  string aggregated_col_name;
+};
+
+logical_plan make_logical_node(logical_op op, vector<logical_plan> inputs) {
+  auto node = std::make_shared<logical_node>();
+  node->op = op;
+  node->inputs = std::move(inputs);
+  return node;
+}
+
+logical_plan logical_csv_scan(string path, vector<string> headers, vector<value_type> column_types = {}) {
+  auto node = make_logical_node(logical_op::csv_scan, {});
+  node->path = path;
+  node->cols = headers;
+  node->column_types = column_types;
+  return node;
+}
+
+// A directory, glob pattern or file scanned with dataset_scan_iterator.
+logical_plan logical_dataset_scan(string path, vector<string> headers, vector<value_type> column_types = {}) {
+  auto node = make_logical_node(logical_op::dataset_scan, {});
+  node->path = path;
+  node->cols = headers;
+  node->column_types = column_types;
+  return node;
+}
+
+logical_plan logical_manual_scan(vector<row_tuple> rows) {
+  auto node = make_logical_node(logical_op::manual_scan, {});
+  std::set<string> cols;
+  for (const auto& t : rows) {
+    for (const auto& p : t.row_data) {
+      cols.insert(p.first);
+    }
+  }
+  node->cols = vector<string>(cols.begin(), cols.end());
+  node->rows = std::move(rows);
+  return node;
+}
+
+logical_plan logical_filter(logical_plan input, bool (*predicate)(const row_tuple&), vector<string> predicate_cols) {
+  auto node = make_logical_node(logical_op::filter, {input});
+  node->predicate = predicate;
+  node->predicate_cols = predicate_cols;
+  return node;
+}
+
+logical_plan logical_project(logical_plan input, vector<string> cols) {
+  auto node = make_logical_node(logical_op::project, {input});
+  node->cols = cols;
+  return node;
+}
+
+logical_plan logical_join(logical_plan input0, logical_plan input1,
+                          vector<std::pair<string, string> > join_on_col0_to_col1) {
+  auto node = make_logical_node(logical_op::join, {input0, input1});
+  node->join_on = join_on_col0_to_col1;
+  return node;
+}
+
+logical_plan logical_sort(logical_plan input, string col_to_sort) {
+  auto node = make_logical_node(logical_op::sort, {input});
+  node->col = col_to_sort;
+  return node;
+}
+
+logical_plan logical_distinct(logical_plan input) {
+  return make_logical_node(logical_op::distinct, {input});
+}
+
+logical_plan logical_average(logical_plan input, string col_to_average,
+                             string aggregated_col_name = "average") {
+  auto node = make_logical_node(logical_op::average, {input});
+  node->col = col_to_average;
+  node->aggregated_col_name = aggregated_col_name;
+  return node;
+}
+
+std::set<string> output_columns(const logical_plan& node) {
+  switch (node->op) {
+    case logical_op::csv_scan:
+    case logical_op::dataset_scan:
+    case logical_op::manual_scan:
+    case logical_op::project:
+      return std::set<string>(node->cols.begin(), node->cols.end());
+    case logical_op::join: {
+      auto cols = output_columns(node->inputs[0]);
+      auto cols1 = output_columns(node->inputs[1]);
+      cols.insert(cols1.begin(), cols1.end());
+      return cols;
+    }
+    case logical_op::average:
+      return {node->aggregated_col_name};
+    default:
+      return output_columns(node->inputs[0]);
+  }
+}
+
+bool has_columns(const std::set<string>& available, const vector<string>& cols) {
+  for (const auto& c : cols) {
+    if (available.count(c) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Number of rows sampled from each scan to estimate statistics.
+const size_t kStatsSampleRows = 1000;
+// Largest number of relations in a join whose order is picked with
+// dynamic programming. Bigger joins keep the order they were written in.
+const size_t kMaxDPJoinRelations = 12;
+// Selectivity of filters that cannot be estimated from a sample.
+const double kDefaultFilterSelectivity = 0.1;
+
+// Relative per-row costs used by query_planner.
+const double kCostCSVRow = 1.0;
+const double kCostMemoryRow = 0.05;
+const double kCostFilterRow = 0.05;
+const double kCostProjectRow = 0.1;
+const double kCostCompare = 0.05;
+const double kCostHashBuildRow = 0.3;
+const double kCostHashProbeRow = 0.15;
+const double kCostOutputRow = 0.1;
+
+class plan_estimate {
+ public:
+  double rows = 0;
+  double cost = 0;
+  // Estimated number of distinct values per column.
+  unordered_map<string, double> distinct;
+  // Rows sampled from a scan, after any filters. Empty if unknown.
+  vector<row_tuple> sample;
+  // Total rows the sample was drawn from.
+  double sample_source_rows = 0;
+  // The column the output is sorted on, "*" if it is sorted on all
+  // columns, or "" if it is not known to be sorted.
+  string sorted_on;
+};
+
+// Estimates the number of distinct values of every column from a sample
+// of `sample.size()` out of `total_rows` rows, with the GEE estimator
+// (Charikar et al.): sqrt(N/n) * f1 + (d - f1), where f1 is the number
+// of values seen exactly once and d the number seen at all.
+unordered_map<string, double> estimate_distinct(const vector<row_tuple>& sample, double total_rows) {
+  unordered_map<string, unordered_map<value, size_t, value_hash> > counts;
+  for (const auto& t : sample) {
+    for (const auto& p : t.row_data) {
+      counts[p.first][p.second]++;
+    }
+  }
+  unordered_map<string, double> distinct;
+  double scale = sample.empty() ? 1 : std::sqrt(total_rows / static_cast<double>(sample.size()));
+  for (const auto& c : counts) {
+    double d = static_cast<double>(c.second.size());
+    double f1 = 0;
+    for (const auto& v : c.second) {
+      f1 += v.second == 1;
+    }
+    distinct[c.first] = std::max(d, std::min(total_rows, scale * f1 + (d - f1)));
+  }
+  return distinct;
+}
+
+// The physical plan chosen by query_planner. Owns its iterators.
+class physical_plan {
+ public:
+  iterator *root() const { return this->root_iterator; }
+
+  // A description of the chosen operators, with estimated rows and cost.
+  string explain() const { return this->explanation; }
+
+  iterator *root_iterator = nullptr;
+  // Declared before `operators` so that they outlive them.
+  vector<std::unique_ptr<memory_tracker> > memory_trackers;
+  vector<std::unique_ptr<iterator> > operators;
+  vector<std::unique_ptr<batch_iterator> > batch_operators;
+  string explanation;
+  plan_estimate estimate;
+};
+
+// Chooses join order and physical operators for a logical plan by
+// estimated cost:
+//   - filters are pushed down as far as their columns allow,
+//   - CSV scans only read columns that something above them uses,
+//   - chains of inner joins are reordered with dynamic programming over
+//     subsets of the joined relations, picking a nested loop, hash or
+//     merge join for each step,
+//   - distinct uses a streaming distinct on sorted input and a hash
+//     distinct otherwise, and sorts already-sorted input for free.
+// Statistics (row counts, distinct values, filter selectivity) come
+// from a sample of the first kStatsSampleRows rows of each scan and the
+// size of each CSV file.
+class query_planner {
+ public:
+  // If `query_memory` is given, each operator that buffers rows charges
+  // them to its own child of it, so the query fails with
+  // memory_limit_exceeded rather than going over its limit, and
+  // query_memory->report() shows per-operator peaks.
+  physical_plan plan(logical_plan root, memory_tracker *query_memory = nullptr) {
+    this->query_memory = query_memory;
+    root = this->clone(root);
+    root = this->push_down_filters(root);
+    this->prune_columns(root, output_columns(root));
+
+    physical_plan result;
+    this->result = &result;
+    auto b = this->build(root);
+    result.root_iterator = b.it;
+    result.explanation = b.explain;
+    result.estimate = b.est;
+    this->result = nullptr;
+    return result;
+  }
+
+ private:
+  // A physical subplan: its root iterator, estimates and explanation.
+  class built {
+   public:
+    iterator *it = nullptr;
+    // Set if the subplan can also hand out row_batches. `it` may then be
+    // null until build() materializes the batches.
+    batch_iterator *batch = nullptr;
+    plan_estimate est;
+    string explain;
+  };
+
+  enum class join_method { nested_loop, hash, merge };
+
+  // One candidate in the join-order search: the best way found so far to
+  // join the relations in a subset.
+  class join_choice {
+   public:
+    bool valid = false;
+    plan_estimate est;
+    size_t mask0 = 0;
+    size_t mask1 = 0;
+    join_method method = join_method::hash;
+    vector<std::pair<string, string> > on;
+  };
+
+  class join_predicate {
+   public:
+    size_t rel0;
+    size_t rel1;
+    string col0;
+    string col1;
+  };
+
+  logical_plan clone(const logical_plan& node) {
+    auto copy = std::make_shared<logical_node>(*node);
+    for (auto& input : copy->inputs) {
+      input = this->clone(input);
+    }
+    return copy;
+  }
+
+  logical_plan push_down_filters(logical_plan node) {
+    for (auto& input : node->inputs) {
+      input = this->push_down_filters(input);
+    }
+    if (node->op == logical_op::filter) {
+      return this->push_filter(node->inputs[0], node);
+    }
+    return node;
+  }
+
+  // Places `filter` as deep as possible below `node` and returns the new
+  // root of the subtree.
+  logical_plan push_filter(logical_plan node, logical_plan filter) {
+    switch (node->op) {
+      case logical_op::filter:
+      case logical_op::project:
+      case logical_op::sort:
+      case logical_op::distinct:
+        node->inputs[0] = this->push_filter(node->inputs[0], filter);
+        return node;
+      case logical_op::join:
+        for (auto& input : node->inputs) {
+          if (has_columns(output_columns(input), filter->predicate_cols)) {
+            input = this->push_filter(input, filter);
+            return node;
+          }
+        }
+        break;
+      case logical_op::dataset_scan: {
+        // Partition pruning is exact, so such filters need no operator.
+        auto keys = dataset_scan_iterator(node->path, node->cols).partition_columns();
+        if (!filter->predicate_cols.empty() &&
+            has_columns(std::set<string>(keys.begin(), keys.end()), filter->predicate_cols)) {
+          node->partition_filters.push_back({filter->predicate, filter->predicate_cols});
+          return node;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    filter->inputs = {node};
+    return filter;
+  }
+
+  // Narrows CSV scans to the columns in `required` (the columns that the
+  // operators above `node` read).
+  void prune_columns(const logical_plan& node, std::set<string> required) {
+    switch (node->op) {
+      case logical_op::csv_scan:
+      case logical_op::dataset_scan: {
+        vector<string> cols;
+        vector<value_type> types;
+        for (size_t i = 0; i < node->cols.size(); i++) {
+          if (required.count(node->cols[i])) {
+            cols.push_back(node->cols[i]);
+            if (!node->column_types.empty()) {
+              types.push_back(node->column_types[i]);
+            }
+          }
+        }
+        node->cols = cols;
+        node->column_types = types;
+        return;
+      }
+      case logical_op::manual_scan:
+        return;
+      case logical_op::filter:
+        required.insert(node->predicate_cols.begin(), node->predicate_cols.end());
+        this->prune_columns(node->inputs[0], required);
+        return;
+      case logical_op::project:
+        this->prune_columns(node->inputs[0], std::set<string>(node->cols.begin(), node->cols.end()));
+        return;
+      case logical_op::join:
+        for (const auto& p : node->join_on) {
+          required.insert(p.first);
+          required.insert(p.second);
+        }
+        for (const auto& input : node->inputs) {
+          this->prune_columns(input, required);
+        }
+        return;
+      case logical_op::sort:
+        if (node->col == "") {
+          // The order depends on every column.
+          required = output_columns(node->inputs[0]);
+        } else {
+          required.insert(node->col);
+        }
+        this->prune_columns(node->inputs[0], required);
+        return;
+      case logical_op::distinct:
+        this->prune_columns(node->inputs[0], output_columns(node->inputs[0]));
+        return;
+      case logical_op::average:
+        this->prune_columns(node->inputs[0], {node->col});
+        return;
+    }
+  }
+
+  // `memory_label` names the operator's memory_tracker, if it buffers
+  // rows.
+  template <typename T>
+  T *add(std::unique_ptr<T> op, const string& memory_label = "") {
+    T *raw = op.get();
+    if (this->query_memory != nullptr && !memory_label.empty()) {
+      this->result->memory_trackers.push_back(
+          std::make_unique<memory_tracker>(memory_label, this->query_memory));
+      raw->track_memory(this->result->memory_trackers.back().get());
+    }
+    this->result->operators.push_back(std::move(op));
+    return raw;
+  }
+
+  template <typename T>
+  T *add_batch(std::unique_ptr<T> op) {
+    T *raw = op.get();
+    this->result->batch_operators.push_back(std::move(op));
+    return raw;
+  }
+
+  static string indent(const string& s) {
+    string out;
+    size_t start = 0;
+    while (start < s.size()) {
+      size_t end = s.find('\n', start);
+      if (end == string::npos) {
+        end = s.size();
+      }
+      out += "  " + s.substr(start, end - start) + "\n";
+      start = end + 1;
+    }
+    return out;
+  }
+
+  static string describe(const string& name, const plan_estimate& est) {
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), " (rows=%.0f cost=%.1f)", est.rows, est.cost);
+    return name + buf + "\n";
+  }
+
+  // Scales the distinct estimates of `est` to at most its row count.
+  static void clamp_distinct(plan_estimate *est) {
+    for (auto& d : est->distinct) {
+      d.second = std::max(1.0, std::min(d.second, est->rows));
+    }
+  }
+
+  static double sort_cost(double rows) {
+    return rows * std::log2(std::max(rows, 2.0)) * kCostCompare + rows * kCostMemoryRow;
+  }
+
+  built build(const logical_plan& node) {
+    auto b = this->build_node(node);
+    if (b.it == nullptr) {
+      b.it = this->add(std::make_unique<materialize_iterator>(b.batch));
+      b.batch = nullptr;
+      b.explain = describe("materialize", b.est) + indent(b.explain);
+    }
+    return b;
+  }
+
+  // Filters and projections over batches stay batches, so that only
+  // the cells they read are parsed until the rows are materialized.
+  built build_node(const logical_plan& node) {
+    switch (node->op) {
+      case logical_op::csv_scan:
+        return this->build_csv_scan(node);
+      case logical_op::dataset_scan:
+        return this->build_dataset_scan(node);
+      case logical_op::manual_scan:
+        return this->build_manual_scan(node);
+      case logical_op::filter:
+        return this->build_filter(node);
+      case logical_op::project: {
+        auto in = this->build_node(node->inputs[0]);
+        built b;
+        if (in.batch != nullptr) {
+          b.batch = this->add_batch(std::make_unique<batch_projection_iterator>(in.batch, node->cols));
+        } else {
+          b.it = this->add(std::make_unique<projection_iterator>(in.it, node->cols));
+        }
+        b.est = in.est;
+        b.est.cost += in.est.rows * kCostProjectRow;
+        unordered_map<string, double> distinct;
+        for (const auto& c : node->cols) {
+          distinct[c] = in.est.distinct.count(c) ? in.est.distinct[c] : in.est.rows;
+        }
+        b.est.distinct = distinct;
+        if (b.est.sorted_on == "*" ||
+            std::find(node->cols.begin(), node->cols.end(), b.est.sorted_on) == node->cols.end()) {
+          b.est.sorted_on = "";
+        }
+        b.explain = describe("project", b.est) + indent(in.explain);
+        return b;
+      }
+      case logical_op::join:
+        return this->build_join(node);
+      case logical_op::sort: {
+        auto in = this->build(node->inputs[0]);
+        auto sorted_on = node->col == "" ? "*" : node->col;
+        if (in.est.sorted_on == sorted_on) {
+          // Already in the requested order.
+          return in;
+        }
+        built b;
+        b.it = this->add(std::make_unique<sort_iterator>(in.it, node->col), "sort " + node->col);
+        b.est = in.est;
+        b.est.cost += sort_cost(in.est.rows);
+        b.est.sorted_on = sorted_on;
+        b.explain = describe("sort(" + node->col + ")", b.est) + indent(in.explain);
+        return b;
+      }
+      case logical_op::distinct:
+        return this->build_distinct(node);
+      case logical_op::average: {
+        auto in = this->build(node->inputs[0]);
+        built b;
+        b.it = this->add(std::make_unique<average_iterator>(in.it, node->col, node->aggregated_col_name));
+        b.est.rows = 1;
+        b.est.cost = in.est.cost + in.est.rows * kCostMemoryRow;
+        b.est.distinct[node->aggregated_col_name] = 1;
+        b.explain = describe("average(" + node->col + ")", b.est) + indent(in.explain);
+        return b;
+      }
+    }
+    throw runtime_error("planner: unknown logical operator");
+  }
+
+  built build_csv_scan(const logical_plan& node) {
+    // Sample the start of the file for statistics.
+    csv_scan_iterator sampler(node->path, node->cols, node->column_types);
+    sampler.init();
+    vector<row_tuple> sample;
+    row_tuple t;
+    while (sample.size() < kStatsSampleRows && sampler.next(&t)) {
+      sample.push_back(t);
+    }
+    bool exhausted = sample.size() < kStatsSampleRows;
+    double sampled_bytes = static_cast<double>(sampler.data_bytes_read());
+    double compression_ratio = sampler.compression_ratio();
+    // Reuse the inferred types so that the real scan does not need to
+    // sample again.
+    auto types = sampler.types_in_use();
+    sampler.close();
+
+    struct stat st;
+    double file_bytes = 0;
+    if (stat(node->path.c_str(), &st) == 0) {
+      file_bytes = static_cast<double>(st.st_size) * compression_ratio;
+    }
+
+    built b;
+    b.est.rows = static_cast<double>(sample.size());
+    if (!exhausted && sampled_bytes > 0) {
+      b.est.rows = std::max(b.est.rows, file_bytes * b.est.rows / sampled_bytes);
+    }
+    b.est.cost = b.est.rows * kCostCSVRow;
+    b.est.sample = std::move(sample);
+    b.est.sample_source_rows = b.est.rows;
+    b.est.distinct = estimate_distinct(b.est.sample, b.est.rows);
+    clamp_distinct(&b.est);
+    auto scan = this->add(std::make_unique<csv_scan_iterator>(node->path, node->cols, types));
+    b.it = scan;
+    b.batch = scan;
+    string cols;
+    for (const auto& c : node->cols) {
+      cols += (cols.empty() ? "" : ", ") + c;
+    }
+    b.explain = describe("csv_scan(" + node->path + ": " + cols + ")", b.est);
+    return b;
+  }
+
+  built build_dataset_scan(const logical_plan& node) {
+    auto scan = std::make_unique<dataset_scan_iterator>(node->path, node->cols, node->column_types);
+    for (const auto& f : node->partition_filters) {
+      scan->add_partition_filter(f.predicate, f.cols);
+    }
+    auto keys = scan->partition_columns();
+    size_t all_files = scan->files_listed();
+    auto files = scan->matching_files();
+
+    // Sample the first file for statistics and scale by the bytes of
+    // all the files that are left.
+    built b;
+    vector<string> csv_cols;
+    for (const auto& c : node->cols) {
+      if (std::find(keys.begin(), keys.end(), c) == keys.end()) {
+        csv_cols.push_back(c);
+      }
+    }
+    if (!files.empty() && !csv_cols.empty()) {
+      io_options sync;
+      sync.async = false;
+      csv_scan_iterator sampler(files[0].path, csv_cols, {}, sync);
+      sampler.init();
+      row_tuple t;
+      while (b.est.sample.size() < kStatsSampleRows && sampler.next(&t)) {
+        b.est.sample.push_back(t);
+      }
+      bool exhausted = b.est.sample.size() < kStatsSampleRows;
+      double sampled_bytes = static_cast<double>(sampler.data_bytes_read());
+      double compression_ratio = sampler.compression_ratio();
+      sampler.close();
+      double total_bytes = 0;
+      for (const auto& f : files) {
+        total_bytes += static_cast<double>(f.bytes) * compression_ratio;
+      }
+      b.est.rows = static_cast<double>(b.est.sample.size());
+      if (sampled_bytes > 0) {
+        double first_bytes = static_cast<double>(files[0].bytes) * compression_ratio;
+        double rows_per_byte = b.est.rows / (exhausted ? std::max(first_bytes, 1.0) : sampled_bytes);
+        b.est.rows = std::max(b.est.rows, total_bytes * rows_per_byte);
+      }
+    } else {
+      b.est.rows = static_cast<double>(files.size());
+    }
+    if (!files.empty()) {
+      auto values = scan->partition_values_of(files[0].path);
+      for (auto& t : b.est.sample) {
+        for (const auto& c : node->cols) {
+          if (values.row_data.count(c)) {
+            t.row_data[c] = values.row_data[c];
+          }
+        }
+      }
+    }
+    // The sample only comes from the first file, so count the partition
+    // values that are left directly.
+    b.est.cost = b.est.rows * kCostCSVRow;
+    b.est.sample_source_rows = b.est.rows;
+    b.est.distinct = estimate_distinct(b.est.sample, b.est.rows);
+    for (const auto& key : keys) {
+      std::set<string> seen;
+      for (const auto& f : files) {
+        for (const auto& p : f.partitions) {
+          if (p.first == key) {
+            seen.insert(p.second);
+          }
+        }
+      }
+      b.est.distinct[key] = std::max<double>(seen.size(), 1);
+    }
+    clamp_distinct(&b.est);
+    b.it = this->add(std::move(scan));
+    string cols;
+    for (const auto& c : node->cols) {
+      cols += (cols.empty() ? "" : ", ") + c;
+    }
+    b.explain = describe("dataset_scan(" + node->path + ": " + cols + "; " + std::to_string(files.size()) +
+                         " of " + std::to_string(all_files) + " files)", b.est);
+    return b;
+  }
+
+  built build_manual_scan(const logical_plan& node) {
+    built b;
+    b.est.rows = static_cast<double>(node->rows.size());
+    b.est.cost = b.est.rows * kCostMemoryRow;
+    b.est.sample = node->rows;
+    b.est.sample_source_rows = b.est.rows;
+    b.est.distinct = estimate_distinct(node->rows, b.est.rows);
+    b.it = this->add(std::make_unique<manual_tuple_scan_iterator>(node->rows));
+    b.explain = describe("manual_tuple_scan", b.est);
+    return b;
+  }
+
+  built build_filter(const logical_plan& node) {
+    auto in = this->build_node(node->inputs[0]);
+    built b;
+    if (in.batch != nullptr) {
+      b.batch = this->add_batch(std::make_unique<batch_selection_iterator>(
+          in.batch, node->predicate, node->predicate_cols));
+    } else {
+      b.it = this->add(std::make_unique<selection_iterator>(in.it, node->predicate));
+    }
+    b.est = in.est;
+    b.est.cost += in.est.rows * kCostFilterRow;
+    if (!in.est.sample.empty()) {
+      vector<row_tuple> passed;
+      for (const auto& t : in.est.sample) {
+        if (node->predicate(t)) {
+          passed.push_back(t);
+        }
+      }
+      // Never estimate zero rows from a sample that missed every match.
+      double selectivity = std::max(static_cast<double>(passed.size()), 0.5) /
+          static_cast<double>(in.est.sample.size());
+      b.est.rows = in.est.rows * selectivity;
+      b.est.sample = std::move(passed);
+      if (!b.est.sample.empty()) {
+        b.est.distinct = estimate_distinct(b.est.sample, b.est.rows);
+      }
+    } else {
+      b.est.rows = in.est.rows * kDefaultFilterSelectivity;
+    }
+    clamp_distinct(&b.est);
+    b.explain = describe("selection", b.est) + indent(in.explain);
+    return b;
+  }
+
+  built build_distinct(const logical_plan& node) {
+    auto in = this->build(node->inputs[0]);
+    built b;
+    b.est = in.est;
+    double distinct_rows = 1;
+    for (const auto& d : in.est.distinct) {
+      distinct_rows *= d.second;
+      if (distinct_rows >= in.est.rows) {
+        break;
+      }
+    }
+    b.est.rows = std::min(in.est.rows, distinct_rows);
+    b.est.sample.clear();
+    clamp_distinct(&b.est);
+
+    double streaming_cost = in.est.rows * kCostCompare;
+    double hash_cost = in.est.rows * kCostHashBuildRow;
+    double sort_then_streaming_cost = sort_cost(in.est.rows) + streaming_cost;
+    if (in.est.sorted_on == "*") {
+      b.it = this->add(std::make_unique<distinct_iterator>(in.it));
+      b.est.cost += streaming_cost;
+      b.explain = describe("distinct", b.est) + indent(in.explain);
+    } else if (hash_cost <= sort_then_streaming_cost) {
+      b.it = this->add(std::make_unique<hash_distinct_iterator>(in.it), "hash distinct");
+      b.est.cost += hash_cost;
+      b.est.sorted_on = in.est.sorted_on;
+      b.explain = describe("hash_distinct", b.est) + indent(in.explain);
+    } else {
+      auto sorted = this->add(std::make_unique<sort_iterator>(in.it, ""), "sort");
+      b.it = this->add(std::make_unique<distinct_iterator>(sorted));
+      b.est.cost += sort_then_streaming_cost;
+      b.est.sorted_on = "*";
+      b.explain = describe("distinct", b.est) + indent(describe("sort()", in.est) + indent(in.explain));
+    }
+    return b;
+  }
+
+  // Collects the relations (maximal non-join subtrees) and equi-join
+  // predicates of a chain of joins. Returns the indexes of the relations
+  // under `node`.
+  vector<size_t> flatten_join(const logical_plan& node, vector<logical_plan> *relations,
+                              vector<join_predicate> *predicates) {
+    if (node->op != logical_op::join) {
+      relations->push_back(node);
+      return {relations->size() - 1};
+    }
+    auto rels0 = this->flatten_join(node->inputs[0], relations, predicates);
+    auto rels1 = this->flatten_join(node->inputs[1], relations, predicates);
+    auto find_relation = [&](const vector<size_t>& rels, const string& col) {
+      for (auto r : rels) {
+        if (output_columns((*relations)[r]).count(col)) {
+          return r;
+        }
+      }
+      throw runtime_error("planner: join column not found: " + col);
+    };
+    for (const auto& p : node->join_on) {
+      predicates->push_back({find_relation(rels0, p.first), find_relation(rels1, p.second),
+                             p.first, p.second});
+    }
+    rels0.insert(rels0.end(), rels1.begin(), rels1.end());
+    return rels0;
+  }
+
+  // Estimates joining `in0` and `in1` with `method`.
+  plan_estimate join_estimate(const plan_estimate& in0, const plan_estimate& in1,
+                              const vector<std::pair<string, string> >& on, join_method method) {
+    plan_estimate est;
+    est.rows = in0.rows * in1.rows;
+    for (const auto& p : on) {
+      auto d0 = in0.distinct.count(p.first) ? in0.distinct.at(p.first) : in0.rows;
+      auto d1 = in1.distinct.count(p.second) ? in1.distinct.at(p.second) : in1.rows;
+      est.rows /= std::max(1.0, std::max(d0, d1));
+    }
+    est.distinct = in0.distinct;
+    for (const auto& d : in1.distinct) {
+      est.distinct[d.first] = d.second;
+    }
+    for (const auto& p : on) {
+      auto d = std::min(est.distinct[p.first], est.distinct[p.second]);
+      est.distinct[p.first] = d;
+      est.distinct[p.second] = d;
+    }
+    clamp_distinct(&est);
+
+    double output_cost = est.rows * kCostOutputRow;
+    switch (method) {
+      case join_method::nested_loop:
+        // input0 is rescanned once per row of input1.
+        est.cost = in1.cost + std::max(in1.rows, 1.0) * in0.cost +
+            in0.rows * in1.rows * kCostCompare + output_cost;
+        est.sorted_on = in1.sorted_on;
+        break;
+      case join_method::hash:
+        est.cost = in0.cost + in1.cost + in1.rows * kCostHashBuildRow +
+            in0.rows * kCostHashProbeRow + output_cost;
+        est.sorted_on = in0.sorted_on;
+        break;
+      case join_method::merge:
+        est.cost = in0.cost + in1.cost + (in0.rows + in1.rows) * kCostCompare + output_cost;
+        if (in0.sorted_on != on[0].first) {
+          est.cost += sort_cost(in0.rows);
+        }
+        if (in1.sorted_on != on[0].second) {
+          est.cost += sort_cost(in1.rows);
+        }
+        est.sorted_on = on[0].first;
+        break;
+    }
+    return est;
+  }
+
+  built build_join(const logical_plan& node) {
+    vector<logical_plan> relations;
+    vector<join_predicate> predicates;
+    this->flatten_join(node, &relations, &predicates);
+
+    // Columns shared by two relations are only allowed as join keys,
+    // since join_tuples() would otherwise pick one of them depending on
+    // the join order.
+    std::set<string> keys;
+    for (const auto& p : predicates) {
+      keys.insert(p.col0);
+      keys.insert(p.col1);
+    }
+    std::set<string> seen;
+    for (const auto& r : relations) {
+      for (const auto& c : output_columns(r)) {
+        if (!seen.insert(c).second && keys.count(c) == 0) {
+          throw runtime_error("planner: column " + c + " is produced by more than one joined relation");
+        }
+      }
+    }
+
+    vector<built> inputs;
+    for (const auto& r : relations) {
+      inputs.push_back(this->build(r));
+    }
+
+    size_t n = relations.size();
+    if (n > kMaxDPJoinRelations) {
+      return this->build_join_in_order(inputs, predicates);
+    }
+    vector<join_choice> best(static_cast<size_t>(1) << n);
+    for (size_t i = 0; i < n; i++) {
+      best[static_cast<size_t>(1) << i].valid = true;
+      best[static_cast<size_t>(1) << i].est = inputs[i].est;
+    }
+
+    size_t full = (static_cast<size_t>(1) << n) - 1;
+    for (size_t mask = 1; mask <= full; mask++) {
+      if ((mask & (mask - 1)) == 0) {
+        continue;
+      }
+      // Prefer splits connected by a predicate; only fall back to cross
+      // products when there are none.
+      for (int allow_cross = 0; allow_cross < 2 && !best[mask].valid; allow_cross++) {
+        for (size_t mask0 = (mask - 1) & mask; mask0 > 0; mask0 = (mask0 - 1) & mask) {
+          size_t mask1 = mask ^ mask0;
+          if (!best[mask0].valid || !best[mask1].valid) {
+            continue;
+          }
+          vector<std::pair<string, string> > on;
+          for (const auto& p : predicates) {
+            size_t b0 = static_cast<size_t>(1) << p.rel0;
+            size_t b1 = static_cast<size_t>(1) << p.rel1;
+            if ((mask0 & b0) && (mask1 & b1)) {
+              on.push_back({p.col0, p.col1});
+            } else if ((mask0 & b1) && (mask1 & b0)) {
+              on.push_back({p.col1, p.col0});
+            }
+          }
+          if (on.empty() && !allow_cross) {
+            continue;
+          }
+          vector<join_method> methods = {join_method::nested_loop};
+          if (!on.empty()) {
+            methods.push_back(join_method::hash);
+          }
+          if (on.size() == 1) {
+            methods.push_back(join_method::merge);
+          }
+          for (auto method : methods) {
+            auto est = this->join_estimate(best[mask0].est, best[mask1].est, on, method);
+            if (!best[mask].valid || est.cost < best[mask].est.cost) {
+              best[mask].valid = true;
+              best[mask].est = est;
+              best[mask].mask0 = mask0;
+              best[mask].mask1 = mask1;
+              best[mask].method = method;
+              best[mask].on = on;
+            }
+          }
+        }
+      }
+    }
+    return this->instantiate_join(best, full, inputs);
+  }
+
+  built instantiate_join(const vector<join_choice>& best, size_t mask, const vector<built>& inputs) {
+    if ((mask & (mask - 1)) == 0) {
+      size_t i = 0;
+      while ((static_cast<size_t>(1) << i) != mask) {
+        i++;
+      }
+      return inputs[i];
+    }
+    const auto& choice = best[mask];
+    auto in0 = this->instantiate_join(best, choice.mask0, inputs);
+    auto in1 = this->instantiate_join(best, choice.mask1, inputs);
+    return this->make_join(in0, in1, choice.on, choice.method);
+  }
+
+  built make_join(built in0, built in1, const vector<std::pair<string, string> >& on, join_method method) {
+    built b;
+    b.est = this->join_estimate(in0.est, in1.est, on, method);
+    string keys;
+    for (const auto& p : on) {
+      keys += (keys.empty() ? "" : ", ") + p.first + " = " + p.second;
+    }
+    switch (method) {
+      case join_method::nested_loop:
+        b.it = this->add(std::make_unique<nested_loop_join_iterator>(in0.it, in1.it, on));
+        b.explain = describe("nested_loop_join(" + keys + ")", b.est);
+        break;
+      case join_method::hash:
+        b.it = this->add(std::make_unique<hash_join_iterator>(in0.it, in1.it, on), "hash join");
+        b.explain = describe("hash_join(" + keys + ")", b.est);
+        break;
+      case join_method::merge:
+        for (auto side : {&in0, &in1}) {
+          const auto& col = side == &in0 ? on[0].first : on[0].second;
+          if (side->est.sorted_on != col) {
+            side->it = this->add(std::make_unique<sort_iterator>(side->it, col), "sort " + col);
+            side->est.cost += sort_cost(side->est.rows);
+            side->est.sorted_on = col;
+            side->explain = describe("sort(" + col + ")", side->est) + indent(side->explain);
+          }
+        }
+        b.it = this->add(std::make_unique<merge_join_iterator>(in0.it, in1.it, on), "merge join");
+        b.explain = describe("merge_join(" + keys + ")", b.est);
+        break;
+    }
+    b.explain += indent(in0.explain) + indent(in1.explain);
+    return b;
+  }
+
+  // Joins the relations left-deep in the order they were written, with
+  // the cheapest method for each step.
+  built build_join_in_order(const vector<built>& inputs,
+                            const vector<join_predicate>& predicates) {
+    built acc = inputs[0];
+    std::set<size_t> joined = {0};
+    for (size_t i = 1; i < inputs.size(); i++) {
+      vector<std::pair<string, string> > on;
+      for (const auto& p : predicates) {
+        if (joined.count(p.rel0) && p.rel1 == i) {
+          on.push_back({p.col0, p.col1});
+        } else if (joined.count(p.rel1) && p.rel0 == i) {
+          on.push_back({p.col1, p.col0});
+        }
+      }
+      auto method = on.empty() ? join_method::nested_loop : join_method::hash;
+      acc = this->make_join(acc, inputs[i], on, method);
+      joined.insert(i);
+    }
+    return acc;
+  }
+
+  physical_plan *result = nullptr;
+  memory_tracker *query_memory = nullptr;
+};
+
+
+void print_data(iterator *it) {
+  it->init();
+  row_tuple t;
+
+  while (it->next(&t)) {
+    bool first = true;
+    for ( const auto& n : t.row_data ) {
+      if (first) {
+        first = false;
+      } else {
+        cout << ", ";
+      }
+      cout << n.first << ": " << n.second;
+    }
+    cout << "\n";
+  }
+
+  it->close();
+}
+
+enum class result_format {
+  // RFC 4180: fields with commas, quotes or newlines are quoted. Nulls
+  // are empty.
+  csv,
+  // Tabs, newlines, carriage returns and backslashes are escaped as \t,
+  // \n, \r and \\. Nulls are \N.
+  tsv,
+  // Little-endian and length-prefixed. The header is "SDBR", a version
+  // byte (1), the column count (u32), then each column name (u32
+  // length, bytes). Each row then holds, per column, a type byte (the
+  // value_type) and the value: nothing for null, 8 bytes for int64,
+  // float64, date and timestamp, or a u32 length and bytes for strings.
+  binary,
+};
+
+const size_t kResultBufferSize = 1 << 20;
+
+// Writes rows to a file descriptor through a large reusable buffer, in
+// a fixed column order. Big strings are handed to writev() next to the
+// buffer instead of being copied into it.
+class result_writer {
+ public:
+  // If `columns` is empty, the columns of the first row are used, in
+  // sorted order.
+  result_writer (int fd, result_format format, vector<string> columns = {},
+                 size_t buffer_size = kResultBufferSize) :
+      fd(fd), format(format), columns(columns), buf(std::max<size_t>(buffer_size, 64)) {}
+
+  // Appends to `out` instead of writing to a file descriptor.
+  result_writer (string *out, result_format format, vector<string> columns = {},
+                 size_t buffer_size = kResultBufferSize) :
+      result_writer(-1, format, columns, buffer_size) {
+    this->out = out;
+  }
+
+  ~result_writer() {
+    // Errors can't be reported from here; call flush() to see them.
+    try {
+      this->flush();
+    } catch (const std::exception&) {
+    }
+  }
+
+  void write_row(row_tuple& t) {
+    if (!this->started) {
+      if (this->columns.empty()) {
+        for (const auto& p : t.row_data) {
+          this->columns.push_back(p.first);
+        }
+        std::sort(this->columns.begin(), this->columns.end());
+      }
+      this->write_header();
+      this->started = true;
+    }
+    for (size_t i = 0; i < this->columns.size(); i++) {
+      auto it = t.row_data.find(this->columns[i]);
+      static const value null_value;
+      const value& v = it == t.row_data.end() ? null_value : it->second;
+      if (this->format == result_format::binary) {
+        this->write_binary_value(v);
+        continue;
+      }
+      if (i > 0) {
+        this->put(this->format == result_format::csv ? ',' : '\t');
+      }
+      this->write_text_value(v);
     }
+    if (this->format != result_format::binary) {
+      this->put('\n');
+    }
+  }
 
+  // Writes every row of `it` (calling init() and close()), then flushes.
+  // Returns the number of rows written.
+  size_t write_all(iterator *it) {
+    size_t rows = 0;
+    it->init();
     row_tuple t;
-    while ( (t = this->input->next()) != EOF_tuple) {
-      if (first || (this->current_row != t)) {
-        this->current_row = t;
-        first = false;
-        return this->current_row;
+    while (it->next(&t)) {
+      this->write_row(t);
+      rows++;
+    }
+    it->close();
+    this->flush();
+    return rows;
+  }
+
+  void flush() {
+    this->write_out(nullptr, 0);
+  }
+
+ private:
+  void write_header() {
+    if (this->format == result_format::binary) {
+      this->append("SDBR\x01", 5);
+      this->put_u32(static_cast<uint32_t>(this->columns.size()));
+      for (const auto& c : this->columns) {
+        this->put_u32(static_cast<uint32_t>(c.size()));
+        this->append(c.data(), c.size());
+      }
+      return;
+    }
+    for (size_t i = 0; i < this->columns.size(); i++) {
+      if (i > 0) {
+        this->put(this->format == result_format::csv ? ',' : '\t');
+      }
+      this->write_text(this->columns[i]);
+    }
+    this->put('\n');
+  }
+
+  void write_text_value(const value& v) {
+    switch (v.type) {
+      case value_type::null:
+        if (this->format == result_format::tsv) {
+          this->append("\\N", 2);
+        }
+        return;
+      case value_type::int64: {
+        char *p = this->reserve(32);
+        this->used = std::to_chars(p, p + 32, v.i).ptr - this->buf.data();
+        return;
+      }
+      case value_type::float64: {
+        char *p = this->reserve(32);
+        this->used = std::to_chars(p, p + 32, v.d).ptr - this->buf.data();
+        return;
+      }
+      case value_type::date:
+      case value_type::timestamp: {
+        auto s = v.to_string();
+        this->append(s.data(), s.size());
+        return;
+      }
+      case value_type::string:
+        this->write_text(v.s);
+        return;
+    }
+  }
+
+  void write_text(const string& s) {
+    if (this->format == result_format::csv) {
+      if (s.find_first_of(",\"\n\r") == string::npos) {
+        this->append(s.data(), s.size());
+        return;
+      }
+      this->put('"');
+      for (char c : s) {
+        if (c == '"') {
+          this->put('"');
+        }
+        this->put(c);
+      }
+      this->put('"');
+      return;
+    }
+    if (s.find_first_of("\t\n\r\\") == string::npos) {
+      this->append(s.data(), s.size());
+      return;
+    }
+    for (char c : s) {
+      switch (c) {
+        case '\t': this->append("\\t", 2); break;
+        case '\n': this->append("\\n", 2); break;
+        case '\r': this->append("\\r", 2); break;
+        case '\\': this->append("\\\\", 2); break;
+        default: this->put(c);
+      }
+    }
+  }
+
+  void write_binary_value(const value& v) {
+    this->put(static_cast<char>(v.type));
+    switch (v.type) {
+      case value_type::null:
+        return;
+      case value_type::float64:
+        this->put_u64(bit_cast_u64(v.d));
+        return;
+      case value_type::string:
+        this->put_u32(static_cast<uint32_t>(v.s.size()));
+        this->append(v.s.data(), v.s.size());
+        return;
+      default:
+        this->put_u64(static_cast<uint64_t>(v.i));
+        return;
+    }
+  }
+
+  static uint64_t bit_cast_u64(double d) {
+    uint64_t u;
+    std::memcpy(&u, &d, sizeof(u));
+    return u;
+  }
+
+  void put_u32(uint32_t v) {
+    char *p = this->reserve(4);
+    for (int i = 0; i < 4; i++) {
+      p[i] = static_cast<char>(v >> (8 * i));
+    }
+    this->used += 4;
+  }
+
+  void put_u64(uint64_t v) {
+    char *p = this->reserve(8);
+    for (int i = 0; i < 8; i++) {
+      p[i] = static_cast<char>(v >> (8 * i));
+    }
+    this->used += 8;
+  }
+
+  void put(char c) {
+    *this->reserve(1) = c;
+    this->used++;
+  }
+
+  // Makes room for `n` bytes (at most the buffer size) and returns where
+  // they go.
+  char *reserve(size_t n) {
+    if (this->buf.size() - this->used < n) {
+      this->flush();
+    }
+    return this->buf.data() + this->used;
+  }
+
+  void append(const char *data, size_t n) {
+    if (n > this->buf.size() / 2) {
+      this->write_out(data, n);
+      return;
+    }
+    std::memcpy(this->reserve(n), data, n);
+    this->used += n;
+  }
+
+  // Writes the buffer, followed by `extra`, retrying on short writes.
+  void write_out(const char *extra, size_t extra_len) {
+    if (this->out != nullptr) {
+      this->out->append(this->buf.data(), this->used);
+      if (extra_len > 0) {
+        this->out->append(extra, extra_len);
+      }
+      this->used = 0;
+      return;
+    }
+    struct iovec iov[2] = {{this->buf.data(), this->used}, {const_cast<char *>(extra), extra_len}};
+    int first = 0;
+    while (first < 2) {
+      if (iov[first].iov_len == 0) {
+        first++;
+        continue;
+      }
+      auto n = writev(this->fd, iov + first, 2 - first);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw runtime_error(string("Could not write results: ") + std::strerror(errno));
+      }
+      auto written = static_cast<size_t>(n);
+      for (int i = first; i < 2 && written > 0; i++) {
+        size_t take = std::min(written, iov[i].iov_len);
+        iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + take;
+        iov[i].iov_len -= take;
+        written -= take;
+      }
+    }
+    this->used = 0;
+  }
+
+  int fd;
+  string *out = nullptr;
+  result_format format;
+  vector<string> columns;
+  vector<char> buf;
+  size_t used = 0;
+  bool started = false;
+};
+
+// The Arrow C data and stream interfaces
+// (https://arrow.apache.org/docs/format/CDataInterface.html), declared
+// here so that no Arrow library is needed. Data is handed over without
+// serialization: whoever receives a struct owns it and calls its
+// release callback when done.
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  const char *format;
+  const char *name;
+  const char *metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema **children;
+  struct ArrowSchema *dictionary;
+  void (*release)(struct ArrowSchema *);
+  void *private_data;
+};
+
+struct ArrowArray {
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void **buffers;
+  struct ArrowArray **children;
+  struct ArrowArray *dictionary;
+  void (*release)(struct ArrowArray *);
+  void *private_data;
+};
+
+#endif  // ARROW_C_DATA_INTERFACE
+
+#ifndef ARROW_C_STREAM_INTERFACE
+#define ARROW_C_STREAM_INTERFACE
+
+struct ArrowArrayStream {
+  int (*get_schema)(struct ArrowArrayStream *, struct ArrowSchema *out);
+  int (*get_next)(struct ArrowArrayStream *, struct ArrowArray *out);
+  const char *(*get_last_error)(struct ArrowArrayStream *);
+  void (*release)(struct ArrowArrayStream *);
+  void *private_data;
+};
+
+#endif  // ARROW_C_STREAM_INTERFACE
+
+// Rows per batch handed out by export_arrow_stream().
+const size_t kArrowBatchRows = 65536;
+
+// Owns the strings and children behind an exported ArrowSchema.
+class arrow_schema_data {
+ public:
+  string format;
+  string name;
+  vector<std::unique_ptr<ArrowSchema> > children;
+  vector<ArrowSchema *> child_ptrs;
+};
+
+// Owns the buffers and children behind an exported ArrowArray.
+class arrow_array_data {
+ public:
+  vector<vector<uint8_t> > buffers;
+  vector<const void *> buffer_ptrs;
+  vector<std::unique_ptr<ArrowArray> > children;
+  vector<ArrowArray *> child_ptrs;
+};
+
+void release_arrow_schema(ArrowSchema *schema) {
+  auto *data = static_cast<arrow_schema_data *>(schema->private_data);
+  for (auto& child : data->children) {
+    if (child->release) {
+      child->release(child.get());
+    }
+  }
+  delete data;
+  schema->release = nullptr;
+}
+
+void release_arrow_array(ArrowArray *array) {
+  auto *data = static_cast<arrow_array_data *>(array->private_data);
+  for (auto& child : data->children) {
+    if (child->release) {
+      child->release(child.get());
+    }
+  }
+  delete data;
+  array->release = nullptr;
+}
+
+// The Arrow format string for columns of `type`. Dates are date32 and
+// timestamps are in seconds, without a time zone.
+const char *arrow_format(value_type type) {
+  switch (type) {
+    case value_type::null: return "n";
+    case value_type::int64: return "l";
+    case value_type::float64: return "g";
+    case value_type::date: return "tdD";
+    case value_type::timestamp: return "tss:";
+    case value_type::string: return "u";
+  }
+  return "n";
+}
+
+void fill_arrow_schema(ArrowSchema *schema, arrow_schema_data *data, int64_t flags) {
+  schema->format = data->format.c_str();
+  schema->name = data->name.c_str();
+  schema->metadata = nullptr;
+  schema->flags = flags;
+  schema->n_children = static_cast<int64_t>(data->children.size());
+  for (auto& child : data->children) {
+    data->child_ptrs.push_back(child.get());
+  }
+  schema->children = data->child_ptrs.empty() ? nullptr : data->child_ptrs.data();
+  schema->dictionary = nullptr;
+  schema->release = release_arrow_schema;
+  schema->private_data = data;
+}
+
+void fill_arrow_array(ArrowArray *array, arrow_array_data *data, int64_t length, int64_t null_count) {
+  array->length = length;
+  array->null_count = null_count;
+  array->offset = 0;
+  array->n_buffers = static_cast<int64_t>(data->buffer_ptrs.size());
+  array->n_children = static_cast<int64_t>(data->children.size());
+  array->buffers = data->buffer_ptrs.empty() ? nullptr : data->buffer_ptrs.data();
+  for (auto& child : data->children) {
+    data->child_ptrs.push_back(child.get());
+  }
+  array->children = data->child_ptrs.empty() ? nullptr : data->child_ptrs.data();
+  array->dictionary = nullptr;
+  array->release = release_arrow_array;
+  array->private_data = data;
+}
+
+// Describes a struct array with one child per column, as used for record
+// batches.
+void export_arrow_schema(const vector<string>& columns, const vector<value_type>& types,
+                         ArrowSchema *schema) {
+  auto *data = new arrow_schema_data();
+  data->format = "+s";
+  for (size_t i = 0; i < columns.size(); i++) {
+    auto *child_data = new arrow_schema_data();
+    child_data->format = arrow_format(types[i]);
+    child_data->name = columns[i];
+    data->children.push_back(std::make_unique<ArrowSchema>());
+    fill_arrow_schema(data->children.back().get(), child_data, ARROW_FLAG_NULLABLE);
+  }
+  fill_arrow_schema(schema, data, 0);
+}
+
+template <typename T>
+void append_arrow_scalar(vector<uint8_t>& buf, T v) {
+  size_t n = buf.size();
+  buf.resize(n + sizeof(T));
+  std::memcpy(buf.data() + n, &v, sizeof(T));
+}
+
+// Copies `col` of `rows` into a column of Arrow `type`. Values of other
+// types are widened (int64 to float64, anything to string).
+void export_arrow_column(const vector<row_tuple>& rows, const string& col, value_type type,
+                         ArrowArray *array) {
+  auto data = std::make_unique<arrow_array_data>();
+  int64_t length = static_cast<int64_t>(rows.size());
+  if (type == value_type::null) {
+    // Null arrays have no buffers, but the rows must still all be null.
+    for (const auto& row : rows) {
+      auto it = row.row_data.find(col);
+      if (it != row.row_data.end() && !it->second.is_null()) {
+        throw runtime_error("Column " + col + " has " + value_type_name(it->second.type) +
+                            " values but is exported as " + value_type_name(type));
+      }
+    }
+    fill_arrow_array(array, data.release(), length, length);
+    return;
+  }
+  vector<uint8_t> validity((rows.size() + 7) / 8, 0);
+  vector<uint8_t> offsets;
+  vector<uint8_t> values;
+  int64_t null_count = 0;
+  if (type == value_type::string) {
+    append_arrow_scalar<int32_t>(offsets, 0);
+  }
+  for (size_t r = 0; r < rows.size(); r++) {
+    auto it = rows[r].row_data.find(col);
+    static const value null_value;
+    const value& v = it == rows[r].row_data.end() ? null_value : it->second;
+    bool is_null = v.is_null();
+    if (is_null) {
+      null_count++;
+    } else {
+      validity[r / 8] |= static_cast<uint8_t>(1 << (r % 8));
+    }
+    if (!is_null && v.type != type && widen_type(v.type, type) != type) {
+      throw runtime_error("Column " + col + " has " + value_type_name(v.type) +
+                          " values but is exported as " + value_type_name(type));
+    }
+    switch (type) {
+      case value_type::int64:
+      case value_type::timestamp:
+        append_arrow_scalar<int64_t>(values, is_null ? 0 : v.i);
+        break;
+      case value_type::float64:
+        append_arrow_scalar<double>(values, is_null ? 0 : v.as_double());
+        break;
+      case value_type::date:
+        if (!is_null && (v.i < INT32_MIN || v.i > INT32_MAX)) {
+          throw runtime_error("Date out of range for Arrow date32: " + v.to_string());
+        }
+        append_arrow_scalar<int32_t>(values, is_null ? 0 : static_cast<int32_t>(v.i));
+        break;
+      case value_type::string: {
+        if (!is_null) {
+          auto s = v.type == value_type::string ? v.s : v.to_string();
+          values.insert(values.end(), s.begin(), s.end());
+        }
+        if (values.size() > INT32_MAX) {
+          throw runtime_error("Column " + col + " has too much string data for one Arrow batch");
+        }
+        append_arrow_scalar<int32_t>(offsets, static_cast<int32_t>(values.size()));
+        break;
+      }
+      case value_type::null:
+        break;
+    }
+  }
+  data->buffers.push_back(std::move(validity));
+  if (type == value_type::string) {
+    data->buffers.push_back(std::move(offsets));
+  }
+  data->buffers.push_back(std::move(values));
+  for (auto& b : data->buffers) {
+    data->buffer_ptrs.push_back(b.data());
+  }
+  // A validity buffer is optional when there are no nulls.
+  if (null_count == 0) {
+    data->buffer_ptrs[0] = nullptr;
+  }
+  fill_arrow_array(array, data.release(), length, null_count);
+}
+
+void export_arrow_rows(const vector<row_tuple>& rows, const vector<string>& columns,
+                       const vector<value_type>& types, ArrowArray *array) {
+  auto *data = new arrow_array_data();
+  // Struct arrays have only a validity buffer, which we leave out.
+  data->buffer_ptrs.push_back(nullptr);
+  try {
+    for (size_t i = 0; i < columns.size(); i++) {
+      data->children.push_back(std::make_unique<ArrowArray>());
+      export_arrow_column(rows, columns[i], types[i], data->children.back().get());
+    }
+  } catch (...) {
+    ArrowArray partial;
+    fill_arrow_array(&partial, data, 0, 0);
+    partial.release(&partial);
+    throw;
+  }
+  fill_arrow_array(array, data, static_cast<int64_t>(rows.size()), 0);
+}
+
+// Reads up to `max_rows` rows of `it`. If `columns` is empty, it is set
+// to the columns of the first row, in sorted order.
+vector<row_tuple> read_arrow_batch_rows(iterator *it, size_t max_rows, vector<string> *columns) {
+  vector<row_tuple> rows;
+  row_tuple t;
+  while (rows.size() < max_rows && it->next(&t)) {
+    rows.push_back(std::move(t));
+  }
+  if (columns->empty() && !rows.empty()) {
+    for (const auto& p : rows[0].row_data) {
+      columns->push_back(p.first);
+    }
+    std::sort(columns->begin(), columns->end());
+  }
+  return rows;
+}
+
+vector<value_type> arrow_column_types(const vector<row_tuple>& rows, const vector<string>& columns) {
+  vector<value_type> types(columns.size(), value_type::null);
+  for (const auto& t : rows) {
+    for (size_t i = 0; i < columns.size(); i++) {
+      auto it = t.row_data.find(columns[i]);
+      if (it != t.row_data.end()) {
+        types[i] = widen_type(types[i], it->second.type);
+      }
+    }
+  }
+  return types;
+}
+
+// Exports up to `max_rows` rows of `it`, which must be initialized, as a
+// record batch: a struct array with a child per column. Column types
+// are those of the rows in this batch. Returns false, leaving `schema`
+// and `array` unset, once `it` has no more rows.
+bool export_arrow_batch(iterator *it, vector<string> columns, size_t max_rows,
+                        ArrowSchema *schema, ArrowArray *array) {
+  auto rows = read_arrow_batch_rows(it, max_rows, &columns);
+  if (rows.empty()) {
+    return false;
+  }
+  auto types = arrow_column_types(rows, columns);
+  export_arrow_rows(rows, columns, types, array);
+  export_arrow_schema(columns, types, schema);
+  return true;
+}
+
+class arrow_stream_data {
+ public:
+  iterator *it;
+  vector<string> columns;
+  size_t batch_size;
+  // Fixed by the first batch, which is held in `pending` until asked for.
+  vector<value_type> types;
+  vector<row_tuple> pending;
+  bool started = false;
+  bool done = false;
+  string last_error;
+
+  void start() {
+    if (this->started) {
+      return;
+    }
+    this->started = true;
+    this->it->init();
+    this->pending = read_arrow_batch_rows(this->it, this->batch_size, &this->columns);
+    this->types = arrow_column_types(this->pending, this->columns);
+    this->finish_if_done(this->pending);
+  }
+
+  void finish_if_done(const vector<row_tuple>& rows) {
+    if (rows.size() < this->batch_size && !this->done) {
+      this->done = true;
+      this->it->close();
+    }
+  }
+};
+
+int arrow_stream_get_schema(ArrowArrayStream *stream, ArrowSchema *out) {
+  auto *data = static_cast<arrow_stream_data *>(stream->private_data);
+  try {
+    data->start();
+    export_arrow_schema(data->columns, data->types, out);
+    return 0;
+  } catch (const std::exception& e) {
+    data->last_error = e.what();
+    return EIO;
+  }
+}
+
+int arrow_stream_get_next(ArrowArrayStream *stream, ArrowArray *out) {
+  auto *data = static_cast<arrow_stream_data *>(stream->private_data);
+  try {
+    data->start();
+    vector<row_tuple> rows;
+    if (!data->pending.empty()) {
+      rows.swap(data->pending);
+    } else if (!data->done) {
+      rows = read_arrow_batch_rows(data->it, data->batch_size, &data->columns);
+      data->finish_if_done(rows);
+    }
+    if (rows.empty()) {
+      // Marks the end of the stream.
+      out->release = nullptr;
+      return 0;
+    }
+    export_arrow_rows(rows, data->columns, data->types, out);
+    return 0;
+  } catch (const std::exception& e) {
+    data->last_error = e.what();
+    return EIO;
+  }
+}
+
+const char *arrow_stream_get_last_error(ArrowArrayStream *stream) {
+  auto *data = static_cast<arrow_stream_data *>(stream->private_data);
+  return data->last_error.empty() ? nullptr : data->last_error.c_str();
+}
+
+void arrow_stream_release(ArrowArrayStream *stream) {
+  auto *data = static_cast<arrow_stream_data *>(stream->private_data);
+  if (data->started && !data->done) {
+    data->it->close();
+  }
+  delete data;
+  stream->release = nullptr;
+}
+
+// Exports the rows of `it` as a stream of record batches. The stream
+// calls init() on `it` when first read and close() when exhausted or
+// released; `it` must outlive it. Column types are fixed by the first
+// batch, so a later batch fails (with get_last_error() set) if a column
+// needs a type that does not widen to the first one. If `columns` is
+// empty, those of the first row are used, in sorted order.
+void export_arrow_stream(iterator *it, vector<string> columns, ArrowArrayStream *out,
+                         size_t batch_size = kArrowBatchRows) {
+  auto *data = new arrow_stream_data();
+  data->it = it;
+  data->columns = std::move(columns);
+  data->batch_size = std::max<size_t>(batch_size, 1);
+  out->get_schema = arrow_stream_get_schema;
+  out->get_next = arrow_stream_get_next;
+  out->get_last_error = arrow_stream_get_last_error;
+  out->release = arrow_stream_release;
+  out->private_data = data;
+}
+
+// Reads one column of an imported record batch in place.
+class arrow_column_reader {
+ public:
+  arrow_column_reader (const ArrowSchema *schema, const ArrowArray *array) :
+      name(schema->name ? schema->name : ""), array(array) {
+    string format = schema->format;
+    if (schema->dictionary != nullptr || array->dictionary != nullptr) {
+      throw runtime_error("Dictionary-encoded Arrow column is not supported: " + this->name);
+    }
+    if (format == "n") {
+      this->kind = value_type::null;
+      return;
+    }
+    static const std::pair<const char *, int> integers[] = {
+      {"c", -1}, {"C", 1}, {"s", -2}, {"S", 2}, {"i", -4}, {"I", 4}, {"l", -8}, {"b", 0},
+    };
+    for (const auto& p : integers) {
+      if (format == p.first) {
+        this->kind = value_type::int64;
+        this->width = p.second;
+        return;
+      }
+    }
+    if (format == "f" || format == "g") {
+      this->kind = value_type::float64;
+      this->width = format == "f" ? 4 : 8;
+    } else if (format == "u" || format == "U") {
+      this->kind = value_type::string;
+      this->width = format == "u" ? -4 : -8;
+    } else if (format == "tdD" || format == "tdm") {
+      this->kind = value_type::date;
+      this->width = format == "tdD" ? -4 : -8;
+      this->divisor = format == "tdD" ? 1 : 86400000;
+    } else if (format.size() >= 4 && format.compare(0, 2, "ts") == 0 && format[3] == ':') {
+      // Timestamps are UTC instants whatever their time zone.
+      this->kind = value_type::timestamp;
+      this->width = -8;
+      switch (format[2]) {
+        case 's': this->divisor = 1; break;
+        case 'm': this->divisor = 1000; break;
+        case 'u': this->divisor = 1000000; break;
+        case 'n': this->divisor = 1000000000; break;
+        default: throw runtime_error("Unsupported Arrow format " + format + " for column " + this->name);
+      }
+    } else {
+      throw runtime_error("Unsupported Arrow format " + format + " for column " + this->name);
+    }
+    if (array->n_buffers != (this->kind == value_type::string ? 3 : 2)) {
+      throw runtime_error("Arrow column " + this->name + " has the wrong number of buffers");
+    }
+  }
+
+  // `row` includes the offset of the parent struct array, which applies
+  // to its children too.
+  value get(int64_t row) const {
+    if (this->kind == value_type::null) {
+      return value();
+    }
+    int64_t i = row + this->array->offset;
+    auto *validity = static_cast<const uint8_t *>(this->array->buffers[0]);
+    if (validity != nullptr && !(validity[i / 8] & (1 << (i % 8)))) {
+      return value();
+    }
+    const void *data = this->array->buffers[1];
+    switch (this->kind) {
+      case value_type::int64:
+        return value(this->read_int(data, i));
+      case value_type::float64:
+        return this->width == 4 ? value(static_cast<double>(read_scalar<float>(data, i)))
+                                : value(read_scalar<double>(data, i));
+      case value_type::date:
+        return value::date(floor_div(this->read_int(data, i), this->divisor));
+      case value_type::timestamp:
+        return value::timestamp(floor_div(read_scalar<int64_t>(data, i), this->divisor));
+      case value_type::string: {
+        int64_t begin = this->read_int(data, i);
+        int64_t end = this->read_int(data, i + 1);
+        auto *chars = static_cast<const char *>(this->array->buffers[2]);
+        return value(string(chars + begin, chars + end));
+      }
+      case value_type::null:
+        break;
+    }
+    return value();
+  }
+
+  string name;
+
+ private:
+  template <typename T>
+  static T read_scalar(const void *data, int64_t i) {
+    T v;
+    std::memcpy(&v, static_cast<const char *>(data) + i * sizeof(T), sizeof(T));
+    return v;
+  }
+
+  // Reads an integer of this column's width.
+  int64_t read_int(const void *data, int64_t i) const {
+    switch (this->width) {
+      case 0: return (static_cast<const uint8_t *>(data)[i / 8] >> (i % 8)) & 1;
+      case -1: return read_scalar<int8_t>(data, i);
+      case 1: return read_scalar<uint8_t>(data, i);
+      case -2: return read_scalar<int16_t>(data, i);
+      case 2: return read_scalar<uint16_t>(data, i);
+      case -4: return read_scalar<int32_t>(data, i);
+      case 4: return read_scalar<uint32_t>(data, i);
+      default: return read_scalar<int64_t>(data, i);
+    }
+  }
+
+  static int64_t floor_div(int64_t a, int64_t b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+  }
+
+  const ArrowArray *array;
+  value_type kind = value_type::null;
+  // Bytes per integer, negative for signed ones; 0 for booleans.
+  int width = -8;
+  int64_t divisor = 1;
+};
+
+// Scans record batches handed over through the Arrow C data interface,
+// reading values straight out of the Arrow buffers. Takes ownership of
+// the schema and batches, which are released when the iterator is
+// destroyed.
+class arrow_scan_iterator : public iterator {
+ public:
+  arrow_scan_iterator (ArrowSchema *schema, vector<ArrowArray *> batches) {
+    this->take(schema, std::move(batches));
+  }
+
+  // Reads every batch from `stream`, then releases the stream.
+  arrow_scan_iterator (ArrowArrayStream *stream) {
+    ArrowSchema schema;
+    vector<ArrowArray *> batches;
+    vector<ArrowArray> arrays;
+    auto fail = [&](const string& what) {
+      const char *err = stream->get_last_error(stream);
+      string message = "Could not read Arrow stream " + what + (err ? string(": ") + err : "");
+      for (auto& a : arrays) {
+        a.release(&a);
+      }
+      stream->release(stream);
+      throw runtime_error(message);
+    };
+    if (stream->get_schema(stream, &schema) != 0) {
+      fail("schema");
+    }
+    while (true) {
+      ArrowArray array;
+      if (stream->get_next(stream, &array) != 0) {
+        schema.release(&schema);
+        fail("batch");
+      }
+      if (array.release == nullptr) {
+        break;
+      }
+      arrays.push_back(array);
+    }
+    stream->release(stream);
+    for (auto& a : arrays) {
+      batches.push_back(&a);
+    }
+    this->take(&schema, std::move(batches));
+  }
+
+  ~arrow_scan_iterator() {
+    this->release_all();
+  }
+
+  void init() {}
+
+  bool next(row_tuple *row) {
+    while (this->batch_index < this->batches.size()) {
+      const auto& batch = this->batches[this->batch_index];
+      if (this->row_index >= batch->length) {
+        this->batch_index++;
+        this->row_index = 0;
+        continue;
+      }
+      const auto& readers = this->readers[this->batch_index];
+      for (const auto& r : readers) {
+        row->row_data[r.name] = r.get(this->row_index + batch->offset);
+      }
+      drop_columns_beyond(readers.size(), [&readers](const string& c) {
+          return std::any_of(readers.begin(), readers.end(),
+                             [&c](const arrow_column_reader& r) { return r.name == c; });
+        }, row);
+      this->row_index++;
+      if (passes_runtime_filters(this->runtime_filters, *row)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void close() {
+    this->batch_index = 0;
+    this->row_index = 0;
+    this->runtime_filters.clear();
+  }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    this->runtime_filters.push_back(filter);
+    return true;
+  }
+
+ private:
+  void release_all() {
+    this->readers.clear();
+    for (auto& batch : this->batches) {
+      if (batch->release) {
+        batch->release(batch.get());
+      }
+    }
+    if (this->schema.release) {
+      this->schema.release(&this->schema);
+    }
+  }
+
+  // Moves `schema` and `batches` into this iterator, marking the
+  // originals released as the C data interface asks of consumers.
+  void take(ArrowSchema *schema, vector<ArrowArray *> batches) {
+    this->schema = *schema;
+    schema->release = nullptr;
+    for (auto *b : batches) {
+      this->batches.push_back(std::make_unique<ArrowArray>(*b));
+      b->release = nullptr;
+    }
+    try {
+      if (string(this->schema.format) != "+s") {
+        throw runtime_error("Arrow import expects a struct array, got format " + string(this->schema.format));
+      }
+      for (const auto& batch : this->batches) {
+        if (batch->n_children != this->schema.n_children) {
+          throw runtime_error("Arrow batch does not match its schema");
+        }
+        if (batch->n_buffers > 0 && batch->buffers[0] != nullptr && batch->null_count != 0) {
+          throw runtime_error("Arrow record batches can't have null rows");
+        }
+        vector<arrow_column_reader> batch_readers;
+        for (int64_t c = 0; c < batch->n_children; c++) {
+          batch_readers.emplace_back(this->schema.children[c], batch->children[c]);
+        }
+        this->readers.push_back(std::move(batch_readers));
+      }
+    } catch (...) {
+      this->release_all();
+      throw;
+    }
+  }
+
+  ArrowSchema schema;
+  vector<std::unique_ptr<ArrowArray> > batches;
+  vector<vector<arrow_column_reader> > readers;
+  size_t batch_index = 0;
+  int64_t row_index = 0;
+  vector<runtime_filter> runtime_filters;
+};
+
+// Reads back rows written by a result_writer in result_format::binary.
+// Every row has every column, with nulls where the writer had none.
+class binary_result_scan_iterator : public iterator {
+ public:
+  binary_result_scan_iterator (std::shared_ptr<const string> data) :
+      data(std::move(data)) {}
+
+  void init() {
+    this->pos = 0;
+    this->columns.clear();
+    // A writer that got no rows writes nothing, not even a header.
+    if (this->data->empty()) {
+      return;
+    }
+    this->need(5);
+    if (this->data->compare(0, 5, "SDBR\x01") != 0) {
+      throw runtime_error("Not a binary result");
+    }
+    this->pos = 5;
+    uint32_t n = this->read_u32();
+    for (uint32_t i = 0; i < n; i++) {
+      uint32_t len = this->read_u32();
+      this->need(len);
+      this->columns.push_back(this->data->substr(this->pos, len));
+      this->pos += len;
+    }
+  }
+
+  bool next(row_tuple *row) {
+    while (this->pos < this->data->size()) {
+      for (const auto& c : this->columns) {
+        this->need(1);
+        auto type = static_cast<value_type>((*this->data)[this->pos++]);
+        value& v = row->row_data[c];
+        switch (type) {
+          case value_type::null:
+            v = value();
+            break;
+          case value_type::int64:
+            v = value(static_cast<int64_t>(this->read_u64()));
+            break;
+          case value_type::float64: {
+            uint64_t u = this->read_u64();
+            double d;
+            std::memcpy(&d, &u, sizeof(d));
+            v = value(d);
+            break;
+          }
+          case value_type::date:
+            v = value::date(static_cast<int64_t>(this->read_u64()));
+            break;
+          case value_type::timestamp:
+            v = value::timestamp(static_cast<int64_t>(this->read_u64()));
+            break;
+          case value_type::string: {
+            uint32_t len = this->read_u32();
+            this->need(len);
+            // Reuses the capacity of the cell's string.
+            v.type = value_type::string;
+            v.i = 0;
+            v.d = 0;
+            v.s.assign(*this->data, this->pos, len);
+            this->pos += len;
+            break;
+          }
+          default:
+            throw runtime_error("Corrupt binary result: bad value type");
+        }
+      }
+      drop_columns_beyond(this->columns.size(), [this](const string& c) {
+          return std::find(this->columns.begin(), this->columns.end(), c) != this->columns.end();
+        }, row);
+      if (passes_runtime_filters(this->runtime_filters, *row)) {
+        return true;
       }
     }
-    this->done = true;
-    return EOF_tuple;
+    return false;
   }
 
   void close() {
-    this->done = false;
-    this->first = true;
-    this->current_row = row_tuple();
-    this->input->close();
+    this->pos = 0;
+    this->runtime_filters.clear();
+  }
+
+  bool push_runtime_filter(const runtime_filter& filter) {
+    this->runtime_filters.push_back(filter);
+    return true;
   }
 
  private:
-  iterator *input;
-  row_tuple current_row;
-  bool first = true;
-  bool done = false;
+  void need(size_t n) const {
+    if (this->data->size() - this->pos < n) {
+      throw runtime_error("Corrupt binary result: truncated");
+    }
+  }
+
+  uint32_t read_u32() {
+    this->need(4);
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+      v |= static_cast<uint32_t>(static_cast<unsigned char>((*this->data)[this->pos + i])) << (8 * i);
+    }
+    this->pos += 4;
+    return v;
+  }
+
+  uint64_t read_u64() {
+    this->need(8);
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+      v |= static_cast<uint64_t>(static_cast<unsigned char>((*this->data)[this->pos + i])) << (8 * i);
+    }
+    this->pos += 8;
+    return v;
+  }
+
+  std::shared_ptr<const string> data;
+  size_t pos = 0;
+  vector<string> columns;
+  vector<runtime_filter> runtime_filters;
 };
 
-class nested_loop_join_iterator : public iterator {
- public:
-  nested_loop_join_iterator (
-      iterator *input0,
-      iterator *input1,
-      vector<std::pair<string, string> > join_on_col0_to_col1
-                             ) :
-      input0(input0), input1(input1), join_on_col0_to_col1(join_on_col0_to_col1) {}
+// Appends `s` to a cache key, length-prefixed so that keys can't run
+// into each other.
+void append_key(string *key, const string& s) {
+  *key += std::to_string(s.size());
+  *key += ':';
+  *key += s;
+}
 
-  void init() {
-    this->input0->init();
-    this->input1->init();
-    this->r1 = this->input1->next();
+// The version of a file: its path, device, inode, size and mtime.
+// "missing" if it can't be stat()ed.
+string file_identity(const string& path) {
+  struct stat st;
+  string id;
+  append_key(&id, path);
+  if (stat(path.c_str(), &st) != 0) {
+    return id + "missing";
   }
+  return id + std::to_string(st.st_dev) + "/" + std::to_string(st.st_ino) + "/" +
+      std::to_string(st.st_size) + "/" + std::to_string(st.st_mtim.tv_sec) + "." +
+      std::to_string(st.st_mtim.tv_nsec);
+}
 
-  row_tuple next() {
-    if (this->done) {
-      return EOF_tuple;
+// A canonical description of `node`, equal for two plans exactly when
+// they compute the same result from the same file versions. Predicates
+// are told apart by their address relative to this function, which is
+// stable across runs of one binary. The CSV files read are added to
+// `paths`.
+string plan_fingerprint(const logical_plan& node, vector<string> *paths) {
+  string key = "(" + std::to_string(static_cast<int>(node->op));
+  auto append_list = [&key](const vector<string>& list) {
+    key += "[";
+    for (const auto& s : list) {
+      append_key(&key, s);
     }
-    if (this->r1 == EOF_tuple) {
-      return EOF_tuple;
+    key += "]";
+  };
+  append_list(node->cols);
+  switch (node->op) {
+    case logical_op::csv_scan:
+      paths->push_back(node->path);
+      key += file_identity(node->path);
+      for (auto t : node->column_types) {
+        key += std::to_string(static_cast<int>(t)) + ",";
+      }
+      break;
+    case logical_op::dataset_scan:
+      // Adding, removing or changing any file changes the key.
+      paths->push_back(node->path);
+      for (const auto& f : list_dataset_files(node->path)) {
+        paths->push_back(f.path);
+        append_key(&key, f.path);
+        key += file_identity(f.path);
+      }
+      for (auto t : node->column_types) {
+        key += std::to_string(static_cast<int>(t)) + ",";
+      }
+      for (const auto& f : node->partition_filters) {
+        key += std::to_string(reinterpret_cast<intptr_t>(f.predicate) -
+                              reinterpret_cast<intptr_t>(&plan_fingerprint));
+        append_list(f.cols);
+      }
+      break;
+    case logical_op::manual_scan: {
+      string rows;
+      result_writer writer(&rows, result_format::binary, node->cols);
+      for (auto t : node->rows) {
+        writer.write_row(t);
+      }
+      writer.flush();
+      append_key(&key, rows);
+      break;
     }
+    case logical_op::filter:
+      key += std::to_string(reinterpret_cast<intptr_t>(node->predicate) -
+                            reinterpret_cast<intptr_t>(&plan_fingerprint));
+      append_list(node->predicate_cols);
+      break;
+    case logical_op::join:
+      for (const auto& p : node->join_on) {
+        append_key(&key, p.first);
+        append_key(&key, p.second);
+      }
+      break;
+    default:
+      append_key(&key, node->col);
+      append_key(&key, node->aggregated_col_name);
+      break;
+  }
+  for (const auto& input : node->inputs) {
+    key += plan_fingerprint(input, paths);
+  }
+  return key + ")";
+}
 
-    while (true) {
-      auto r0 = this->input0->next();
-      if (r0 == EOF_tuple) {
-        this->input0->close();
+// Identifies this binary, so that disk cache entries (whose predicate
+// addresses only mean something to the binary that wrote them) are not
+// used by another build.
+const string& executable_identity() {
+  static const string id = file_identity("/proc/self/exe");
+  return id;
+}
 
-        this->r1 = this->input1->next();
-        if (this->r1 == EOF_tuple) {
-          // Both inputs are exhausted, we're done.
-          this->done = true;
-          return EOF_tuple;
-        }
-        // Restart input0
-        this->input0->init();
-        r0 = this->input0->next();
-        if (r0 == EOF_tuple) {
-          // input0 is an empty table
-          this->done = true;
-          return EOF_tuple;
-        }
+const size_t kResultCacheBytes = 256 << 20;
+
+// Caches query results, in result_writer's binary format, under the
+// plan_fingerprint() of their plans. Since the fingerprint includes the
+// version of every file read, a changed file simply stops matching and
+// its stale results age out. Entries are dropped least recently used
+// first to stay within a memory budget; with a disk directory, they are
+// also written there, to be found after eviction or a restart.
+class result_cache {
+ public:
+  result_cache (size_t memory_budget = kResultCacheBytes, string disk_dir = "") :
+      memory_budget(memory_budget), disk_dir(disk_dir) {}
+
+  // Returns an iterator over the rows of `plan`, from the cache or from
+  // running it (and caching the result). Rows come back with every
+  // output column, nulls included.
+  std::unique_ptr<iterator> execute(const logical_plan& plan) {
+    vector<string> paths;
+    auto key = plan_fingerprint(plan, &paths);
+    auto data = this->lookup(key, paths);
+    if (data == nullptr) {
+      auto result = std::make_shared<string>();
+      auto cols = output_columns(plan);
+      auto physical = query_planner().plan(plan);
+      result_writer writer(result.get(), result_format::binary, vector<string>(cols.begin(), cols.end()));
+      writer.write_all(physical.root());
+      data = result;
+      // Don't cache a result read from a file that changed meanwhile.
+      vector<string> paths_after;
+      if (plan_fingerprint(plan, &paths_after) == key) {
+        this->insert(key, data, paths, true);
       }
+    }
+    return std::make_unique<binary_result_scan_iterator>(data);
+  }
 
-      bool is_match = true;
-      for (const auto& p : this->join_on_col0_to_col1) {
-        if (r0.row_data[p.first] != r1.row_data[p.second]) {
-          is_match = false;
-          break;
+  // Drops the entries for plans that read `path`, from memory and disk.
+  void invalidate(const string& path) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (auto it = this->lru.begin(); it != this->lru.end(); ) {
+      if (std::find(it->paths.begin(), it->paths.end(), path) != it->paths.end()) {
+        if (!this->disk_dir.empty()) {
+          unlink(this->disk_path(it->key).c_str());
         }
-      }
-      if (is_match) {
-        return join_tuples(r0, r1);
+        it = this->erase(it);
+      } else {
+        ++it;
       }
     }
   }
 
-  void close() {
-    // input0 is already closed at this point.
-    this->input1->close();
-    this->r1 = row_tuple();
-    this->done = false;
+  // Drops every entry in memory (but not on disk).
+  void clear() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->lru.clear();
+    this->index.clear();
+    this->bytes_used = 0;
   }
 
+  size_t hits = 0;
+  size_t disk_hits = 0;
+  size_t misses = 0;
+  size_t bytes_used = 0;
+
  private:
-  iterator *input0;
-  iterator *input1;
-  row_tuple r1;
-  vector<std::pair<string, string> > join_on_col0_to_col1;
-  int done = false;
-};
+  class entry {
+   public:
+    string key;
+    std::shared_ptr<const string> data;
+    vector<string> paths;
+    size_t bytes;
+  };
 
+  std::shared_ptr<const string> lookup(const string& key, const vector<string>& paths) {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      auto it = this->index.find(key);
+      if (it != this->index.end()) {
+        this->lru.splice(this->lru.begin(), this->lru, it->second);
+        this->hits++;
+        return it->second->data;
+      }
+    }
+    auto data = this->read_disk(key);
+    if (data != nullptr) {
+      this->insert(key, data, paths, false);
+    }
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (data == nullptr) {
+      this->misses++;
+    } else {
+      this->disk_hits++;
+    }
+    return data;
+  }
 
-void print_data(iterator *it) {
-  it->init();
-  row_tuple t;
+  void insert(const string& key, const std::shared_ptr<const string>& data,
+              const vector<string>& paths, bool to_disk) {
+    if (to_disk && !this->disk_dir.empty()) {
+      this->write_disk(key, *data);
+    }
+    std::lock_guard<std::mutex> lock(this->mutex);
+    size_t bytes = key.size() + data->size();
+    if (bytes > this->memory_budget || this->index.count(key) > 0) {
+      return;
+    }
+    this->lru.push_front({key, data, paths, bytes});
+    this->index[key] = this->lru.begin();
+    this->bytes_used += bytes;
+    while (this->bytes_used > this->memory_budget) {
+      this->erase(std::prev(this->lru.end()));
+    }
+  }
 
-  while ( (t = it->next()) != EOF_tuple ) {
-    bool first = true;
-    for ( const auto& n : t.row_data ) {
-      if (first) {
-        first = false;
-      } else {
-        cout << ", ";
-      }
-      cout << n.first << ": " << n.second;
+  std::list<entry>::iterator erase(std::list<entry>::iterator it) {
+    this->bytes_used -= it->bytes;
+    this->index.erase(it->key);
+    return this->lru.erase(it);
+  }
+
+  string disk_path(const string& key) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.sdbr",
+                  static_cast<unsigned long long>(mix_hash(std::hash<string>()(key))));
+    return this->disk_dir + "/" + name;
+  }
+
+  // Disk entries hold the binary's identity and the key, then the
+  // result; a file for another key (a hash collision) is a miss.
+  std::shared_ptr<const string> read_disk(const string& key) {
+    if (this->disk_dir.empty()) {
+      return nullptr;
     }
-    cout << "\n";
+    auto fp = std::fopen(this->disk_path(key).c_str(), "rb");
+    if (fp == nullptr) {
+      return nullptr;
+    }
+    string contents;
+    char buf[65536];
+    size_t n;
+    while ((n = std::fread(buf, 1, sizeof(buf), fp)) > 0) {
+      contents.append(buf, n);
+    }
+    std::fclose(fp);
+    string header;
+    append_key(&header, executable_identity());
+    append_key(&header, key);
+    if (contents.compare(0, header.size(), header) != 0) {
+      return nullptr;
+    }
+    return std::make_shared<const string>(contents.substr(header.size()));
   }
 
-  it->close();
+  void write_disk(const string& key, const string& data) {
+    auto path = this->disk_path(key);
+    auto tmp = path + ".tmp" + std::to_string(getpid());
+    auto fp = std::fopen(tmp.c_str(), "wb");
+    if (fp == nullptr) {
+      // The disk tier is best effort.
+      return;
+    }
+    string header;
+    append_key(&header, executable_identity());
+    append_key(&header, key);
+    bool ok = std::fwrite(header.data(), 1, header.size(), fp) == header.size() &&
+        std::fwrite(data.data(), 1, data.size(), fp) == data.size();
+    ok = std::fclose(fp) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+      unlink(tmp.c_str());
+    }
+  }
+
+  size_t memory_budget;
+  string disk_dir;
+  std::mutex mutex;
+  std::list<entry> lru;
+  unordered_map<string, std::list<entry>::iterator> index;
+};
+
+void test_result_writer() {
+  auto m_node = manual_tuple_scan_iterator({
+      row_tuple({{"name", "samer"}, {"age", 11.5}}),
+          row_tuple({{"name", "john \"jj\", jr"}, {"age", 30}}),
+          row_tuple({{"name", "fred\tthe\\great"}, {"age", value()}}),
+          row_tuple({{"name", "my grandmother"}, {"age", 110.1}})
+    });
+
+  cout.flush();
+  for (auto format : {result_format::csv, result_format::tsv}) {
+    result_writer writer(1, format, {"name", "age"});
+    writer.write_all(&m_node);
+  }
 }
 
 void test_movies_csv() {
   auto s = csv_scan_iterator("/home/samer/src/db/resources/movielens/movies.csv", {"movieid", "title"});
 
-  auto selection_node = selection_iterator(&s, [](row_tuple t) -> bool {
-      return t.row_data["movieid"] == "24";
+  auto selection_node = selection_iterator(&s, [](const row_tuple& t) -> bool {
+      return t.row_data.at("movieid") == 24;
     });
 
   auto projection_node = projection_iterator(&selection_node, {"title"});
@@ -498,10 +7109,10 @@ void test_movies_csv() {
 
 void test_average_iterator() {
   auto m_node = manual_tuple_scan_iterator({
-      row_tuple({{"name", "samer"}, {"age", "11.5"}}),
-          row_tuple({{"name", "john"}, {"age", "30"}}),
-          row_tuple({{"name", "fred"}, {"age", "20"}}),
-          row_tuple({{"name", "my grandmother"}, {"age", "110.1"}})
+      row_tuple({{"name", "samer"}, {"age", 11.5}}),
+          row_tuple({{"name", "john"}, {"age", 30}}),
+          row_tuple({{"name", "fred"}, {"age", 20}}),
+          row_tuple({{"name", "my grandmother"}, {"age", 110.1}})
     });
 
   auto a_node = average_iterator(&m_node, "age");
@@ -512,36 +7123,105 @@ void test_average_iterator() {
 void test_ratings_csv() {
   auto cs_node = csv_scan_iterator("/home/samer/src/db/resources/movielens/ratings-100.csv", {"movieid", "rating"});
 
-  auto s_node = selection_iterator(&cs_node, [](row_tuple t) -> bool {
-      return t.row_data["movieid"] == "1222";
+  auto s_node = selection_iterator(&cs_node, [](const row_tuple& t) -> bool {
+      return t.row_data.at("movieid") == 1222;
+    });
+
+  auto a_node = average_iterator(&s_node, "rating");
+
+  print_data(&a_node);
+}
+
+void test_compressed_ratings_csv() {
+  // gzip and zstd files are detected by their contents.
+  for (const auto& path : {"/home/samer/src/db/resources/movielens/ratings-100.csv.gz",
+                           "/home/samer/src/db/resources/movielens/ratings-100.csv.zst"}) {
+    auto cs_node = csv_scan_iterator(path, {"movieid", "rating"});
+
+    auto a_node = average_iterator(&cs_node, "rating");
+
+    print_data(&a_node);
+  }
+
+  // A corrupt frame header fails at once rather than after buffering.
+  string path = "/tmp/samerdb_test_corrupt.csv.zst";
+  FILE *fp = std::fopen(path.c_str(), "wb");
+  const unsigned char header[] = {0x28, 0xb5, 0x2f, 0xfd, 0x08};
+  std::fwrite(header, 1, sizeof(header), fp);
+  string zeros(4 << 20, '\0');
+  std::fwrite(zeros.data(), 1, zeros.size(), fp);
+  std::fclose(fp);
+  try {
+    auto cs_node = csv_scan_iterator(path, {"movieid", "rating"});
+    print_data(&cs_node);
+  } catch (const runtime_error& e) {
+    cout << e.what() << "\n";
+  }
+}
+
+void test_async_ratings_csv() {
+  io_options options;
+  options.queue_depth = 16;
+  options.block_size = 1 << 20;
+  options.direct = true;
+  auto cs_node = csv_scan_iterator("/home/samer/src/db/resources/movielens/ratings-100.csv",
+                                   {"movieid", "rating"}, {}, options);
+
+  auto a_node = average_iterator(&cs_node, "rating");
+
+  a_node.init();
+  row_tuple t;
+  a_node.next(&t);
+  cout << t.row_data["average"] << "\n";
+  auto stats = cs_node.stats();
+  cout << stats.backend << ": " << stats.reads << " reads, " << stats.bytes_read
+       << " bytes, " << stats.io_wait_seconds << "s waiting\n";
+  a_node.close();
+}
+
+void test_follow_ratings_csv() {
+  // Each run only reads the ratings appended since the previous run.
+  checkpoint_file checkpoint("/home/samer/src/db/resources/movielens/ratings-100.checkpoint");
+  auto cs_node = csv_scan_iterator("/home/samer/src/db/resources/movielens/ratings-100.csv",
+                                   {"movieid", "rating"}, {value_type::int64, value_type::float64});
+  cs_node.follow(&checkpoint);
+
+  auto s_node = selection_iterator(&cs_node, [](const row_tuple& t) -> bool {
+      return t.row_data.at("movieid") == 1222;
     });
 
   auto a_node = average_iterator(&s_node, "rating");
+  a_node.keep_running_state(&checkpoint, "movie 1222");
 
   print_data(&a_node);
+  checkpoint.save();
 }
 
 void test_sort_iterator() {
   auto m_node = manual_tuple_scan_iterator({
-      row_tuple({{"name", "samer"}, {"age", "11.5"}}),
-          row_tuple({{"name", "john"}, {"age", "30"}}),
-          row_tuple({{"name", "fred"}, {"age", "20"}}),
-          row_tuple({{"name", "my grandmother"}, {"age", "110.1"}})
+      row_tuple({{"name", "samer"}, {"age", 11.5}}),
+          row_tuple({{"name", "john"}, {"age", 30}}),
+          row_tuple({{"name", "fred"}, {"age", 20}}),
+          row_tuple({{"name", "my grandmother"}, {"age", 110.1}})
     });
 
   auto s_node = sort_iterator(&m_node, "name");
 
   print_data(&s_node);
+
+  auto age_node = sort_iterator(&m_node, "age");
+
+  print_data(&age_node);
 }
 
 void test_distinct_iterator() {
   auto m_node = manual_tuple_scan_iterator({
-      row_tuple({{"name", "samer"}, {"age", "11.5"}}),
-          row_tuple({{"name", "john"}, {"age", "30"}}),
-          row_tuple({{"name", "john"}, {"age", "30"}}),
-          row_tuple({{"name", "john"}, {"age", "30"}}),
-          row_tuple({{"name", "fred"}, {"age", "20"}}),
-          row_tuple({{"name", "my grandmother"}, {"age", "110.1"}})
+      row_tuple({{"name", "samer"}, {"age", 11.5}}),
+          row_tuple({{"name", "john"}, {"age", 30}}),
+          row_tuple({{"name", "john"}, {"age", 30}}),
+          row_tuple({{"name", "john"}, {"age", 30}}),
+          row_tuple({{"name", "fred"}, {"age", 20}}),
+          row_tuple({{"name", "my grandmother"}, {"age", 110.1}})
     });
 
   auto s_node = sort_iterator(&m_node, "");
@@ -553,19 +7233,19 @@ void test_distinct_iterator() {
 
 void test_nested_loop_join_iterator() {
   auto m_node0 = manual_tuple_scan_iterator({
-      row_tuple({{"t0.name", "samer"}, {"t0.age", "11.5"}}),
-          row_tuple({{"t0.name", "john"}, {"t0.age", "30"}}),
-          row_tuple({{"t0.name", "fred"}, {"t0.age", "20"}}),
-          row_tuple({{"t0.name", "my grandmother"}, {"t0.age", "110.1"}}),
-          row_tuple({{"t0.name", "extra person"}, {"t0.age", "30"}}),
-          row_tuple({{"t0.name", "another extra person"}, {"t0.age", "30"}}),
+      row_tuple({{"t0.name", "samer"}, {"t0.age", 11.5}}),
+          row_tuple({{"t0.name", "john"}, {"t0.age", 30}}),
+          row_tuple({{"t0.name", "fred"}, {"t0.age", 20}}),
+          row_tuple({{"t0.name", "my grandmother"}, {"t0.age", 110.1}}),
+          row_tuple({{"t0.name", "extra person"}, {"t0.age", 30}}),
+          row_tuple({{"t0.name", "another extra person"}, {"t0.age", 30}}),
     });
 
   auto m_node1 = manual_tuple_scan_iterator({
-      row_tuple({{"t1.name", "samer"}, {"t1.income", "400"}}),
-          row_tuple({{"t1.name", "john"}, {"t1.income", "300"}}),
-          row_tuple({{"t1.name", "fred"}, {"t1.income", "200"}}),
-          row_tuple({{"t1.name", "my grandmother"}, {"t1.income", "11000"}})
+      row_tuple({{"t1.name", "samer"}, {"t1.income", 400}}),
+          row_tuple({{"t1.name", "john"}, {"t1.income", 300}}),
+          row_tuple({{"t1.name", "fred"}, {"t1.income", 200}}),
+          row_tuple({{"t1.name", "my grandmother"}, {"t1.income", 11000}})
     });
 
   auto nlj_node = nested_loop_join_iterator(
@@ -575,11 +7255,469 @@ void test_nested_loop_join_iterator() {
   print_data(&nlj_node);
 }
 
+void test_merge_join_iterator() {
+  auto m_node0 = manual_tuple_scan_iterator({
+      row_tuple({{"t0.name", "samer"}, {"t0.age", 11.5}}),
+          row_tuple({{"t0.name", "john"}, {"t0.age", 30}}),
+          row_tuple({{"t0.name", "john"}, {"t0.age", 31}}),
+          row_tuple({{"t0.name", "fred"}, {"t0.age", 20}}),
+          row_tuple({{"t0.name", "extra person"}, {"t0.age", 30}}),
+    });
+
+  auto m_node1 = manual_tuple_scan_iterator({
+      row_tuple({{"t1.name", "samer"}, {"t1.income", 400}}),
+          row_tuple({{"t1.name", "john"}, {"t1.income", 300}}),
+          row_tuple({{"t1.name", "john"}, {"t1.income", 350}}),
+          row_tuple({{"t1.name", "my grandmother"}, {"t1.income", 11000}})
+    });
+
+  auto s_node0 = sort_iterator(&m_node0, "t0.name");
+  auto s_node1 = sort_iterator(&m_node1, "t1.name");
+
+  auto mj_node = merge_join_iterator(
+      &s_node0, &s_node1,
+      {{"t0.name", "t1.name"}});
+  print_data(&mj_node);
+
+  auto outer_node = merge_join_iterator(
+      &s_node0, &s_node1,
+      {{"t0.name", "t1.name"}}, join_type::left_outer);
+  print_data(&outer_node);
+
+  auto semi_node = merge_join_iterator(
+      &s_node0, &s_node1,
+      {{"t0.name", "t1.name"}}, join_type::semi);
+  print_data(&semi_node);
+}
+
+void test_hash_join_runtime_filter() {
+  auto movies_node = csv_scan_iterator("/home/samer/src/db/resources/movielens/movies.csv", {"movieid", "title"});
+  auto s_node = selection_iterator(&movies_node, [](const row_tuple& t) -> bool {
+      return t.row_data.at("title") == "Toy Story (1995)";
+    });
+  auto ratings_node = csv_scan_iterator("/home/samer/src/db/resources/movielens/ratings-100.csv", {"movieid", "rating"});
+
+  // Builds on the (small) filtered movies, and pushes a Bloom filter of
+  // their ids into the ratings scan.
+  auto hj_node = hash_join_iterator(&ratings_node, &s_node, {{"movieid", "movieid"}});
+  auto a_node = average_iterator(&hj_node, "rating");
+
+  a_node.init();
+  row_tuple t;
+  a_node.next(&t);
+  cout << t.row_data["average"] << "\n";
+  cout << ratings_node.rows_rejected_by_runtime_filters() << " ratings rejected by the Bloom filter\n";
+  a_node.close();
+}
+
+void test_query_planner() {
+  auto people = logical_manual_scan({
+      row_tuple({{"t0.name", "samer"}, {"t0.age", 11.5}}),
+          row_tuple({{"t0.name", "john"}, {"t0.age", 30}}),
+          row_tuple({{"t0.name", "fred"}, {"t0.age", 20}}),
+          row_tuple({{"t0.name", "my grandmother"}, {"t0.age", 110.1}})
+    });
+  auto incomes = logical_manual_scan({
+      row_tuple({{"t1.name", "samer"}, {"t1.income", 400}}),
+          row_tuple({{"t1.name", "john"}, {"t1.income", 300}}),
+          row_tuple({{"t1.name", "fred"}, {"t1.income", 200}}),
+          row_tuple({{"t1.name", "my grandmother"}, {"t1.income", 11000}})
+    });
+  auto cities = logical_manual_scan({
+      row_tuple({{"t2.income", 400}, {"t2.city", "oakland"}}),
+          row_tuple({{"t2.income", 11000}, {"t2.city", "sf"}})
+    });
+
+  auto joined = logical_join(
+      logical_join(people, incomes, {{"t0.name", "t1.name"}}),
+      cities, {{"t1.income", "t2.income"}});
+  auto filtered = logical_filter(joined, [](const row_tuple& t) -> bool {
+      return t.row_data.at("t0.age") > 15;
+    }, {"t0.age"});
+  auto projected = logical_project(filtered, {"t0.name", "t2.city"});
+
+  auto plan = query_planner().plan(projected);
+  cout << plan.explain();
+  print_data(plan.root());
+}
+
+void test_arrow_round_trip() {
+  auto m_node = manual_tuple_scan_iterator({
+      row_tuple({{"name", "samer"}, {"age", 11.5}, {"born", value::date(18000)}}),
+          row_tuple({{"name", "john"}, {"age", 30}, {"born", value()}}),
+          row_tuple({{"name", value()}, {"age", 110.1}, {"born", value::date(-3)}})
+    });
+
+  // What a consumer such as pyarrow's RecordBatchReader._import_from_c
+  // would receive, in batches of two rows.
+  ArrowArrayStream stream;
+  export_arrow_stream(&m_node, {"name", "age", "born"}, &stream, 2);
+  arrow_scan_iterator a_node(&stream);
+  print_data(&a_node);
+
+  // "nickname" is all null in the first batch, so it is exported as a
+  // null column and the later value cannot be.
+  auto n_node = manual_tuple_scan_iterator({
+      row_tuple({{"name", "samer"}, {"nickname", value()}}),
+          row_tuple({{"name", "john"}, {"nickname", value()}}),
+          row_tuple({{"name", "fred"}, {"nickname", "freddy"}})
+    });
+  ArrowArrayStream n_stream;
+  export_arrow_stream(&n_node, {"name", "nickname"}, &n_stream, 2);
+  try {
+    arrow_scan_iterator n_scan(&n_stream);
+    print_data(&n_scan);
+  } catch (const runtime_error& e) {
+    cout << e.what() << "\n";
+  }
+}
+
+void test_memory_limit() {
+  auto ratings = logical_csv_scan("/home/samer/src/db/resources/movielens/ratings-100.csv",
+                                  {"movieid", "rating"});
+  auto sorted = logical_sort(ratings, "rating");
+
+  for (int64_t limit : {int64_t(1) << 30, int64_t(1) << 20}) {
+    memory_tracker query("query", &process_memory_tracker(), limit);
+    auto plan = query_planner().plan(sorted, &query);
+    try {
+      plan.root()->init();
+      size_t rows = 0;
+      row_tuple t;
+      while (plan.root()->next(&t)) {
+        rows++;
+      }
+      cout << rows << " rows\n";
+    } catch (const memory_limit_exceeded& e) {
+      cout << e.what() << "\n";
+    }
+    plan.root()->close();
+    cout << query.report();
+  }
+}
+
+void test_late_materialization() {
+  auto cs_node = csv_scan_iterator("/home/samer/src/db/resources/movielens/ratings-100.csv",
+                                   {"userid", "movieid", "rating", "timestamp"});
+
+  // Only movieid is parsed for every row, and rating for the matches.
+  auto s_node = batch_selection_iterator(&cs_node, [](const row_tuple& t) -> bool {
+      return t.row_data.at("movieid") == 1222;
+    }, {"movieid"});
+  auto p_node = batch_projection_iterator(&s_node, {"rating"});
+  auto m_node = materialize_iterator(&p_node);
+
+  auto a_node = average_iterator(&m_node, "rating");
+
+  print_data(&a_node);
+}
+
+void test_approximate_operators() {
+  auto path = "/home/samer/src/db/resources/movielens/ratings-100.csv";
+
+  auto users = csv_scan_iterator(path, {"userid"});
+  auto distinct_users = approx_count_distinct_iterator(&users, {"userid"}, "users");
+  print_data(&distinct_users);
+
+  auto ratings = csv_scan_iterator(path, {"rating"});
+  auto median = approx_quantile_iterator(&ratings, "rating", 0.5, "median");
+  print_data(&median);
+
+  auto sampled = csv_scan_iterator(path, {"rating"});
+  sampled.sample_blocks(0.1);
+  auto sampled_average = average_iterator(&sampled, "rating");
+  print_data(&sampled_average);
+
+  auto all = csv_scan_iterator(path, {"userid", "rating"});
+  auto reservoir = reservoir_sample_iterator(&all, 5);
+  print_data(&reservoir);
+}
+
+void test_result_cache() {
+  auto ratings = logical_csv_scan("/home/samer/src/db/resources/movielens/ratings-100.csv",
+                                  {"movieid", "rating"});
+  auto filtered = logical_filter(ratings, [](const row_tuple& t) -> bool {
+      return t.row_data.at("movieid") == 1222;
+    }, {"movieid"});
+  auto averaged = logical_average(filtered, "rating");
+
+  result_cache cache;
+  for (int i = 0; i < 2; i++) {
+    auto start = std::chrono::steady_clock::now();
+    auto result = cache.execute(averaged);
+    print_data(result.get());
+    cout << std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count()
+         << "us (" << cache.hits << " hits, " << cache.misses << " misses)\n";
+  }
+}
+
+void test_dataset_scan() {
+  // sales/region=<r>/year=<y>/part-0.csv, plus a marker file that is not
+  // part of the dataset.
+  string root = "/tmp/samerdb_test_dataset";
+  mkdir(root.c_str(), 0755);
+  for (string region : {"east", "west"}) {
+    mkdir((root + "/region=" + region).c_str(), 0755);
+    for (int year = 2021; year <= 2023; year++) {
+      string dir = root + "/region=" + region + "/year=" + std::to_string(year);
+      mkdir(dir.c_str(), 0755);
+      FILE *fp = std::fopen((dir + "/part-0.csv").c_str(), "w");
+      std::fprintf(fp, "item,amount\n");
+      for (int i = 0; i < 3; i++) {
+        std::fprintf(fp, "item%d,%d\n", i, (year - 2020) * 10 + i);
+      }
+      std::fclose(fp);
+    }
+  }
+  std::fclose(std::fopen((root + "/_SUCCESS").c_str(), "w"));
+
+  // The filter on year skips files; the one on amount is a plain filter.
+  auto filtered = logical_filter(
+      logical_filter(logical_dataset_scan(root, {"region", "year", "item", "amount"}),
+                     [](const row_tuple& t) -> bool { return t.row_data.at("year") > 2021; }, {"year"}),
+      [](const row_tuple& t) -> bool { return t.row_data.at("amount") > 20; }, {"amount"});
+  auto plan = query_planner().plan(logical_sort(filtered, "amount"));
+  cout << plan.explain();
+  print_data(plan.root());
+}
+
+void test_fused_pipeline() {
+  auto cs_node = csv_scan_iterator("/home/samer/src/db/resources/movielens/ratings-100.csv",
+                                   {"userid", "movieid", "rating", "timestamp"});
+
+  // Same as test_ratings_csv, as one loop over the scan's batches.
+  double average = fused_batches(&cs_node)
+      .filter("movieid", [](const value& v) { return v == 1222; })
+      .project({"rating"})
+      .average("rating");
+  cout << "average: " << average << "\n";
+
+  auto m_node = manual_tuple_scan_iterator({
+      row_tuple({{"name", "samer"}, {"age", 11.5}}),
+          row_tuple({{"name", "john"}, {"age", 30}}),
+          row_tuple({{"name", "my grandmother"}, {"age", 110.1}})
+    });
+  auto adults = fused_rows(&m_node)
+      .filter("age", [](const value& v) { return v > 18; })
+      .project({"name"})
+      .collect();
+  for (const auto& t : adults) {
+    cout << t.row_data.at("name") << "\n";
+  }
+
+  // As after a projection_iterator, "age" is gone after the project().
+  int64_t with_age = fused_rows(&m_node)
+      .project({"name"})
+      .filter("age", [](const value& v) { return !v.is_null(); })
+      .count();
+  cout << with_age << " rows with an age\n";
+}
+
+// Builds with SAMERDB_COUNT_ALLOCATIONS (//samerdb:db_count_allocations)
+// count calls to the global operator new, so that tests can check that
+// rows flow through operators without allocating. Other builds keep the
+// standard allocator.
+#ifdef SAMERDB_COUNT_ALLOCATIONS
+std::atomic<size_t> allocation_count{0};
+
+void *operator new(size_t n) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(n == 0 ? 1 : n)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+// Used by std::stable_sort; replaced too, so that every allocation is
+// freed by the operator delete below.
+void *operator new(size_t n, const std::nothrow_t&) noexcept {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(n == 0 ? 1 : n);
+}
+
+// GCC cannot see that operator new is replaced as well.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+#endif  // SAMERDB_COUNT_ALLOCATIONS
+
+void test_steady_state_allocations() {
+#ifndef SAMERDB_COUNT_ALLOCATIONS
+  throw runtime_error("Counting allocations needs a build with SAMERDB_COUNT_ALLOCATIONS, "
+                      "such as //samerdb:db_count_allocations");
+#else
+  // The same plans over a file and over one twice as long: once buffers
+  // have grown, the extra rows must not allocate.
+  const int kRows = 50000;
+  string paths[2];
+  for (int i = 0; i < 2; i++) {
+    paths[i] = "/tmp/samerdb_test_allocations_" + std::to_string(i) + ".csv";
+    FILE *fp = std::fopen(paths[i].c_str(), "w");
+    std::fprintf(fp, "movieId,rating,title\n");
+    for (int r = 0; r < kRows * (i + 1); r++) {
+      std::fprintf(fp, "%d,%.1f,Movie number %06d\n", r % 37, (r % 10) / 2.0, r);
+    }
+    std::fclose(fp);
+  }
+
+  auto count_allocations = [](iterator *root) {
+    size_t before = allocation_count.load();
+    root->init();
+    row_tuple t;
+    while (root->next(&t)) {}
+    root->close();
+    return allocation_count.load() - before;
+  };
+  auto is_early = [](const row_tuple& t) -> bool { return t.row_data.at("movieid") < 30; };
+  vector<std::pair<string, std::function<size_t(const string&)> > > plans = {
+    {"scan -> filter -> project", [&](const string& path) {
+        auto plan = query_planner().plan(logical_project(
+            logical_filter(logical_csv_scan(path, {"movieid", "rating", "title"}), is_early, {"movieid"}),
+            {"rating", "title"}));
+        return count_allocations(plan.root());
+      }},
+    {"scan -> filter -> average", [&](const string& path) {
+        auto plan = query_planner().plan(logical_average(
+            logical_filter(logical_csv_scan(path, {"movieid", "rating", "title"}), is_early, {"movieid"}),
+            "rating"));
+        return count_allocations(plan.root());
+      }},
+    {"row scan -> selection -> projection -> average", [&](const string& path) {
+        auto cs_node = csv_scan_iterator(path, {"movieid", "rating", "title"});
+        auto s_node = selection_iterator(&cs_node, is_early);
+        auto p_node = projection_iterator(&s_node, {"rating", "title"});
+        auto a_node = average_iterator(&p_node, "rating");
+        return count_allocations(&a_node);
+      }},
+  };
+  for (const auto& p : plans) {
+    size_t once = p.second(paths[0]);
+    size_t twice = p.second(paths[1]);
+    cout << p.first << ": " << once << " allocations for " << kRows << " rows, "
+         << twice << " for " << 2 * kRows << "\n";
+    // A few buffers may still grow once more.
+    if (twice > once + 16) {
+      throw runtime_error(p.first + " allocates per row");
+    }
+  }
+#endif  // SAMERDB_COUNT_ALLOCATIONS
+}
+
+void test_parallel_sort() {
+  // Mixed types, nulls, embedded zero bytes and duplicate keys, sorted on
+  // one thread and on all cores, against a plain comparison sort.
+  const size_t kRows = 500000;
+  vector<row_tuple> rows;
+  std::mt19937_64 rng(42);
+  for (size_t r = 0; r < kRows; r++) {
+    row_tuple t;
+    switch (rng() % 4) {
+      case 0: t.row_data["a"] = value(static_cast<int64_t>(rng() % 50) - 25); break;
+      case 1: t.row_data["a"] = value((rng() % 100) / 4.0 - 12.5); break;
+      case 2: t.row_data["a"] = value(string("x\0y", rng() % 4)); break;
+      default: break;
+    }
+    t.row_data["b"] = value("s" + std::to_string(rng() % 1000));
+    t.row_data["id"] = value(static_cast<int64_t>(r));
+    rows.push_back(t);
+  }
+  vector<sort_key> keys = {{"a"}, {"b", true}};
+  auto expected = rows;
+  std::stable_sort(expected.begin(), expected.end(), [&keys](const row_tuple& x, const row_tuple& y) {
+    for (const auto& k : keys) {
+      auto at = [&k](const row_tuple& t) {
+        auto cell = t.row_data.find(k.col);
+        return cell == t.row_data.end() ? value() : cell->second;
+      };
+      int c = compare_values(at(x), at(y));
+      if (c != 0) {
+        return k.descending ? c > 0 : c < 0;
+      }
+    }
+    return false;
+  });
+
+  for (size_t threads : {size_t(1), size_t(4), size_t(0)}) {
+    auto m_node = manual_tuple_scan_iterator(rows);
+    auto s_node = sort_iterator(&m_node, keys, threads);
+    auto start = std::chrono::steady_clock::now();
+    s_node.init();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    row_tuple t;
+    size_t i = 0;
+    while (s_node.next(&t)) {
+      if (t.row_data.at("id") != expected[i].row_data.at("id")) {
+        throw runtime_error("Sort order differs at row " + std::to_string(i));
+      }
+      i++;
+    }
+    s_node.close();
+    if (i != kRows) {
+      throw runtime_error("Sort lost rows");
+    }
+    cout << (threads ? std::to_string(threads) + " threads" : "all cores") << ": sorted " << i << " rows in " << elapsed.count() << "ms\n";
+  }
+
+  auto cs_node = csv_scan_iterator("/home/samer/src/db/resources/movielens/ratings-100.csv",
+                                   {"userid", "movieid", "rating", "timestamp"});
+  auto s_node = sort_iterator(&cs_node, {{"rating", true}, {"timestamp"}});
+  s_node.init();
+  row_tuple t;
+  for (int i = 0; i < 5 && s_node.next(&t); i++) {
+    cout << "rating: " << t.row_data.at("rating") << ", timestamp: " << t.row_data.at("timestamp") << "\n";
+  }
+  s_node.close();
+}
+
+void test_malformed_cells() {
+  // "nan" and "inf" are not numbers, nor 2021-02-29 a date: inferred as
+  // strings, and rejected in float64 and date columns.
+  string path = "/tmp/samerdb_test_cells.csv";
+  FILE *fp = std::fopen(path.c_str(), "w");
+  std::fprintf(fp, "score,day\n1222,2020-02-29\nnan,2021-02-29\ninf,2021-03-02\n");
+  std::fclose(fp);
+
+  auto inferred = csv_scan_iterator(path, {"score", "day"});
+  inferred.init();
+  for (auto type : inferred.types_in_use()) {
+    cout << value_type_name(type) << "\n";
+  }
+  inferred.close();
+
+  for (auto score_type : {value_type::float64, value_type::string}) {
+    auto typed = csv_scan_iterator(path, {"score", "day"}, {score_type, value_type::date});
+    try {
+      print_data(&typed);
+    } catch (const runtime_error& e) {
+      cout << e.what() << "\n";
+    }
+  }
+}
+
 int main() {
   // test_movies_csv();
   // test_average_iterator();
   // test_ratings_csv();
+  // test_compressed_ratings_csv();
+  // test_async_ratings_csv();
+  // test_follow_ratings_csv();
   // test_sort_iterator();
   // test_distinct_iterator();
-  test_nested_loop_join_iterator();
+  // test_nested_loop_join_iterator();
+  // test_merge_join_iterator();
+  // test_hash_join_runtime_filter();
+  // test_query_planner();
+  // test_result_writer();
+  // test_arrow_round_trip();
+  // test_memory_limit();
+  // test_late_materialization();
+  // test_approximate_operators();
+  // test_result_cache();
+  // test_fused_pipeline();
+  // test_dataset_scan();
+  // test_steady_state_allocations();
+  // test_parallel_sort();
+  test_malformed_cells();
 }